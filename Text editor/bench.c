@@ -0,0 +1,236 @@
+// bench.c - microbenchmarks for the row and syntax kernels of kilo.c
+//
+// Build with "make bench" and run "./bench [lines] [min_ms]". Results are
+// printed as tab-separated lines: benchmark name, iterations, nanoseconds
+// per iteration and, where it makes sense, megabytes processed per second.
+// The large corpora have 10M lines unless told otherwise, which takes about
+// 2.5 GB of memory; pass a smaller count for a quick run.
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+// Struct to describe one benchmark result.
+struct benchResult {
+  const char *name;         // Benchmark name.
+  long long iters;          // Iterations timed.
+  double ns_per_op;         // Average time per iteration.
+  double mb_per_s;          // Throughput, or 0 when not meaningful.
+};
+
+int bench_lines = 10000000; // Rows in the large corpora.
+long long bench_min_ns = 200000000LL; // Minimum time spent per benchmark.
+volatile long long bench_sink;  // Keeps results of pure kernels observable.
+
+/*** corpora ***/
+
+// Function to drop every row and all per-buffer state built on them.
+void benchReset() {
+  editorFreeAllRows();
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  editorUndoReset();
+}
+
+// Function to append a row without recording it in the undo log.
+void benchAddRow(char *s, int len) {
+  E.undo.suspended++;
+  editorInsertRow(E.numrows, s, len);
+  E.undo.suspended--;
+}
+
+// Function to build a corpus of ordinary C-like source lines.
+void benchCorpusLines(int lines) {
+  char buf[128];
+  benchReset();
+  for (int i = 0; i < lines; i++) {
+    int len = snprintf(buf, sizeof(buf),
+                       "  int value_%d = compute(%d, \"text\"); // note %d", i, i * 3, i);
+    benchAddRow(buf, len);
+  }
+}
+
+// Function to build a corpus made of one very long line.
+void benchCorpusLongLine(int len, int tabs) {
+  char *buf = malloc(len);
+  for (int i = 0; i < len; i++)
+    buf[i] = (tabs && i % 9 == 0) ? '\t' : "abcdefgh ij"[i % 11];
+  benchReset();
+  benchAddRow(buf, len);
+  free(buf);
+}
+
+// Function to build a corpus of tab-indented lines.
+void benchCorpusTabs(int lines) {
+  char buf[128];
+  benchReset();
+  for (int i = 0; i < lines; i++) {
+    int len = snprintf(buf, sizeof(buf), "\t\t\tif (x%d)\t{\treturn\t%d;\t}", i, i);
+    benchAddRow(buf, len);
+  }
+}
+
+// Function to build a corpus that is one deep block comment.
+void benchCorpusComment(int lines) {
+  char buf[128];
+  benchReset();
+  benchAddRow("/*", 2);
+  for (int i = 0; i < lines; i++) {
+    int len = snprintf(buf, sizeof(buf), " * comment line %d with \"quotes\" and 123", i);
+    benchAddRow(buf, len);
+  }
+  benchAddRow(" */", 3);
+}
+
+// Function to build a corpus of log lines with accented, CJK and emoji text.
+void benchCorpusUtf8(int lines) {
+  char buf[160];
+  benchReset();
+  for (int i = 0; i < lines; i++) {
+    int len = snprintf(buf, sizeof(buf),
+                       "%d INFO café résumé 日本語のログ\t%d 😀 naïve", i, i * 7);
+    benchAddRow(buf, len);
+  }
+}
+
+/*** harness ***/
+
+// Function to run a benchmark body until enough time has been spent.
+// Each call of the body is one iteration and returns the bytes it processed.
+struct benchResult benchRun(const char *name, long long (*body)(void)) {
+  struct benchResult r = { name, 0, 0, 0 };
+  long long bytes = 0;
+  long long start = editorNowNs();
+  long long elapsed = 0;
+  while (elapsed < bench_min_ns) {
+    bytes += body();
+    r.iters++;
+    elapsed = editorNowNs() - start;
+  }
+  r.ns_per_op = (double)elapsed / r.iters;
+  if (bytes) r.mb_per_s = bytes / (elapsed / 1e9) / 1e6;
+  printf("%s\t%lld\t%.1f\t%.2f\n", r.name, r.iters, r.ns_per_op, r.mb_per_s);
+  fflush(stdout);
+  return r;
+}
+
+/*** benchmarks ***/
+
+// Function to re-render the first row.
+long long benchUpdateRow() {
+  editorUpdateRow(&E.row[0]);
+  return E.row[0].size;
+}
+
+// Function to re-render every row of the corpus.
+long long benchUpdateAllRows() {
+  long long bytes = 0;
+  for (int j = 0; j < E.numrows; j++) {
+    editorUpdateRow(&E.row[j]);
+    bytes += E.row[j].size;
+  }
+  return bytes;
+}
+
+// Function to toggle the comment opener and re-highlight what follows.
+long long benchUpdateSyntax() {
+  // Reopening the comment re-highlights the whole cascade below it.
+  E.row[0].chars[1] = E.row[0].chars[1] == '*' ? '/' : '*';
+  editorUpdateRow(&E.row[0]);
+  return 0;
+}
+
+// Function to map the end of the first row from chars to render columns.
+long long benchCxToRx() {
+  erow *row = &E.row[0];
+  bench_sink = editorRowCxToRx(row, row->size);
+  return row->size;
+}
+
+// Function to map the end of the first row from render to chars columns.
+long long benchRxToCx() {
+  erow *row = &E.row[0];
+  bench_sink = editorRowRxToCx(row, row->rsize);
+  return row->size;
+}
+
+// Function to serialize the buffer in memory.
+long long benchRowsToString() {
+  int len;
+  char *buf = editorRowsToString(&len);
+  free(buf);
+  return len;
+}
+
+// Function to stream the buffer to /dev/null the way editorSave does.
+long long benchWriteRows() {
+  int fd = open("/dev/null", O_WRONLY);
+  long long len = editorWriteRows(fd, CODEC_NONE);
+  close(fd);
+  return len;
+}
+
+// Function to run a search that fails.
+long long benchFindScan() {
+  // The query never matches, so every row is scanned once.
+  editorFindCallback("no such text", 0);
+  editorFindCallback("no such text", '\r');
+  return 0;
+}
+
+// Function to render one screenful of rows.
+long long benchDrawRows() {
+  struct abuf ab = ABUF_INIT;
+  if (V.len == 0) editorViewInit();
+  // Unchanged lines are skipped; time a full repaint instead.
+  editorViewDamage();
+  editorDrawRows(&ab, &V.v[0]);
+  long long len = ab.len;
+  abFree(&ab);
+  return len;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 2) bench_lines = atoi(argv[1]);
+  if (argc >= 3) bench_min_ns = atoll(argv[2]) * 1000000LL;
+
+  initEditor();
+  E.batch = 1;
+  E.filename = strdup("bench.c");
+  editorSelectSyntaxHighlight();
+
+  printf("name\titers\tns_per_op\tmb_per_s\n");
+
+  benchCorpusLongLine(1 << 20, 0);
+  benchRun("update_row/long_line_1M", benchUpdateRow);
+  benchRun("cx_to_rx/long_line_1M", benchCxToRx);
+  benchRun("rx_to_cx/long_line_1M", benchRxToCx);
+
+  benchCorpusLongLine(1 << 20, 1);
+  benchRun("update_row/long_tabbed_line_1M", benchUpdateRow);
+  benchRun("cx_to_rx/long_tabbed_line_1M", benchCxToRx);
+  benchRun("rx_to_cx/long_tabbed_line_1M", benchRxToCx);
+
+  benchCorpusTabs(10000);
+  benchRun("update_row/tab_heavy_10k", benchUpdateAllRows);
+
+  benchCorpusComment(100000);
+  benchRun("update_syntax/comment_block_100k", benchUpdateSyntax);
+
+  benchCorpusLines(bench_lines);
+  benchRun("update_row/source_lines", benchUpdateAllRows);
+  benchRun("rows_to_string/source_lines", benchRowsToString);
+  benchRun("write_rows/source_lines", benchWriteRows);
+  benchRun("find_scan/source_lines", benchFindScan);
+  while (editorTriIndexStep());
+  benchRun("find_indexed/source_lines", benchFindScan);
+  editorTriIndexFree();
+  benchRun("draw_rows/source_lines", benchDrawRows);
+  E.rowoff = E.numrows / 2;
+  benchRun("draw_rows/source_lines_middle", benchDrawRows);
+
+  benchCorpusUtf8(bench_lines / 10);
+  benchRun("update_row/utf8_lines", benchUpdateAllRows);
+  E.rowoff = 0;
+  benchRun("draw_rows/utf8_lines", benchDrawRows);
+
+  benchReset();
+  return 0;
+}
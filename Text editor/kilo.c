@@ -26,6 +26,22 @@ enum editorHighlight {
   HL_MATCH           // Matching character (for example, a closing parenthesis)
 };
 
+// This enum defines the kinds of records kept in the undo log.
+enum editorUndoType {
+  UNDO_INS = 1,      // Characters inserted into a row
+  UNDO_DEL,          // Characters deleted from a row
+  UNDO_REPL,         // Characters in a row replaced by others
+  UNDO_ROW_INS,      // Row inserted
+  UNDO_ROW_DEL       // Row deleted
+};
+
+// This enum defines the compression formats files can be stored in.
+enum editorCodecType {
+  CODEC_NONE = 0,    // Plain text
+  CODEC_GZIP,        // gzip (or zlib), needs -DKILO_GZIP
+  CODEC_ZSTD         // Zstandard, needs -DKILO_ZSTD
+};
+
 // Bitwise flags for enabling specific types of syntax highlighting.
 #define HL_HIGHLIGHT_NUMBERS (1<<0) // Flag for highlighting numbers
 #define HL_HIGHLIGHT_STRINGS (1<<1) // Flag for highlighting strings
@@ -49,20 +65,199 @@ typedef struct erow {
   int idx;                  // Index of the row in the editor.
   int size;                 // Size of the row's character buffer.
   int rsize;                // Size of the row's render buffer (used for tabs).
-  char *chars;              // Buffer containing the actual text characters.
-  char *render;             // Buffer for rendering characters with tabs and syntax highlighting.
-  unsigned char *hl;        // Array storing the syntax highlighting information for each character.
-  int hl_open_comment;      // Flag indicating if the row has an open multi-line comment.
+  int tabs;                 // Tabs in chars; while 0, render aliases chars.
+  int *rxmap;               // rx at every KILO_RX_STEP-th cx, built on demand for long rows with tabs.
+  int *wrap;                // Starts of the visual lines after the first, per recent wrap width; see editorRowWrap.
+  char *chars;              // Buffer containing the actual text characters; also owns render and hl.
+  char *render;             // Rendered characters, right after chars, or chars itself if there are no tabs.
+  unsigned char *hl;        // Syntax highlighting of the rendered characters, after render.
+  int hl_runs;              // Number of (class, length) pairs in hl, or 0 if hl is one byte per character.
+  unsigned char hl_open_comment; // Flag indicating if the row has an open multi-line comment.
+  unsigned char utf8;       // Flag set when chars may hold non-ASCII bytes, whose columns take decoding.
 } erow;
 
+// Number of slab size classes, see slabClassSize.
+#define SLAB_CLASSES 17
+#define SLAB_BIG SLAB_CLASSES // Class tag of blocks too large for a slab
+
+// Header in front of row blocks served straight from malloc.
+typedef struct slabBig {
+  struct slabBig *prev, *next; // Neighbours in the pool's list of big blocks.
+  size_t size;              // Usable size of the block.
+  unsigned int pad;
+  unsigned int cls;         // Always SLAB_BIG; sits right before the payload.
+} slabBig;
+
+// Struct to represent the allocator for row buffers (chars, render and hl).
+// Small blocks are carved out of large chunks by size class and recycled
+// through free lists; everything is released at once when the rows go away.
+struct rowPool {
+  char *chunks;             // Chunk list; the first word links to the next.
+  char *cur;                // Unused tail of the newest chunk.
+  size_t left;              // Bytes left at cur.
+  void *free[SLAB_CLASSES]; // Free lists of recycled blocks per class.
+  slabBig *big;             // Blocks too large for the slabs.
+  size_t bytes;             // Memory taken for chunks and big blocks.
+};
+
+// Struct to hold slab chunks given back by released pools, so any buffer
+// (or loader thread) can reuse them before asking malloc for more.
+struct rowSpare {
+  pthread_mutex_t lock;     // Guards the list; loader threads allocate too.
+  char *chunks;             // Chunk list; the first word links to the next.
+  int count;                // Number of chunks in the list.
+};
+
+// Struct to hold the sorted list of row blocks containing one trigram bucket.
+typedef struct tripost {
+  int *blocks;              // Ascending numbers of the blocks with the trigram.
+  int len;                  // Number of blocks in the list.
+  int cap;                  // Allocated capacity of the list.
+} tripost;
+
+// Struct to represent the trigram search index over the rendered rows.
+struct editorTrigramIndex {
+  tripost *buckets;         // Posting lists, NULL until the index is started.
+  int *first;               // First row of each block, then the end of the last.
+  int nblocks;              // Number of blocks indexed.
+  int blockcap;             // Allocated capacity of first.
+  int built;                // Rows [0, built) are covered by the postings.
+  int *touched;             // Indexed rows edited since they were indexed (sorted).
+  int ntouched;             // Number of entries in touched.
+  int gen;                  // Bumped whenever the candidate sets may change.
+  char *query;              // Query the cached candidate list belongs to.
+  int query_gen;            // Value of gen when the candidate list was built.
+  int *cand;                // Cached candidate rows for query (ascending).
+  int ncand;                // Number of cached candidate rows.
+};
+
+// Header of one undo record. It is followed by the old text, the new text and
+// the total record size, so records can be walked from either end.
+typedef struct undoRec {
+  unsigned char type;       // One of enum editorUndoType.
+  unsigned char flags;      // UNDO_COALESCE if later keystrokes may extend it.
+  unsigned int group;       // Records sharing a group are undone together.
+  int row, col;             // Position of the edit.
+  int oldlen, newlen;       // Length of the text before and after the edit.
+} undoRec;
+
+#define UNDO_COALESCE (1<<0) // Record is a keystroke run that may still grow
+
+// Struct to hold an append-only stack of undo records.
+struct undoLog {
+  char *buf;                // Record bytes; live records are in [start, len).
+  size_t start;             // Offset of the oldest record still kept.
+  size_t len;               // End of the newest record.
+  size_t cap;               // Allocated size of buf.
+};
+
+// Struct to represent the undo/redo state of the buffer.
+struct editorUndo {
+  struct undoLog undo;      // Edits that can be undone, newest last.
+  struct undoLog redo;      // Undone edits that can be redone, next last.
+  unsigned int group;       // Id of the last group handed out.
+  unsigned int dropped;     // Group that overflowed the cap and is not kept.
+  int depth;                // Nesting depth of explicit groups.
+  int suspended;            // Recording is off while replaying or loading.
+  int sealed;               // Set when the next record must not coalesce.
+  size_t limit;             // Maximum bytes kept in the undo log.
+};
+
+// Struct to hold a Fenwick tree over the byte length of each row, newline
+// included, so byte offsets and rows map to each other in O(log n).
+struct editorLineIndex {
+  long long *tree;          // 1-based Fenwick tree; node i covers rows (i - lowbit(i), i].
+  int cap;                  // Allocated nodes, not counting the unused node 0.
+  int valid;                // Nodes 1..valid are up to date; the rest are rebuilt on demand.
+};
+
+// Struct to represent a streaming decompressor or compressor.
+struct editorCodec {
+  int type;                 // CODEC_* format, CODEC_NONE when unused.
+  int encode;               // Set for a compressor.
+  int done;                 // Set once a decompressor saw the end of its data.
+  void *state;              // z_stream or ZSTD_DStream/ZSTD_CStream.
+};
+
+// Struct to represent a file that is still being turned into rows.
+struct editorLoader {
+  char *data;               // Mapped file contents, or NULL when nothing is loading.
+  size_t size;              // Size of the mapping.
+  size_t pos;               // Bytes loaded so far; always at the start of a line.
+  size_t step;              // Bytes per slice, sized to take about KILO_LOAD_SLICE_MS.
+  struct editorCodec dec;   // Decompressor when the file is compressed.
+  char *out;                // Decompressed bytes not yet turned into rows.
+  size_t outlen;            // Number of bytes in out.
+  size_t outcap;            // Allocated size of out.
+};
+
+// Kinds of read-only views of files that are not turned into rows.
+enum editorRawMode {
+  RAW_OFF = 0,
+  RAW_HEX,
+  RAW_LINES
+};
+
+// Struct to represent a file shown straight from its mapping instead of as
+// rows: binary files as a hex dump, files with huge lines through a window
+// of columns.
+struct editorRaw {
+  int mode;                 // RAW_HEX or RAW_LINES, or RAW_OFF for a normal buffer.
+  char *data;               // Mapped file contents.
+  size_t mapped;            // Size of the mapping.
+  size_t size;              // Bytes shown: all of them unless the view had to stop short.
+  int digits;               // Hex digits of the offsets in the hex dump, at least 8.
+  size_t *starts;           // Offsets of the lines found so far, for RAW_LINES.
+  int nlines;               // Number of entries in starts.
+  int cap;                  // Allocated size of starts.
+  size_t scanned;           // Bytes searched for line ends so far.
+};
+
+// Struct to represent follow mode, which appends what is written to the file.
+struct editorFollow {
+  int fd;                   // inotify descriptor watching the file's directory, or -1.
+  char *name;               // Name of the file within that directory.
+  ino_t ino;                // Inode the rows were read from, to notice rotation.
+  off_t size;               // Bytes of the file turned into rows so far.
+  off_t tail;               // Start of the last row if it had no newline yet, else -1.
+};
+
+// Struct to represent what the open file looked like when it was last read
+// or written, to notice other programs changing it.
+struct editorDisk {
+  long long size;           // Size of the file.
+  long long mtime;          // Modification time in nanoseconds.
+  ino_t ino;                // Inode, which changes when the file is replaced.
+  long long checked;        // Monotonic time of the last check in milliseconds.
+  int warned;               // Set once the user was told about the change.
+};
+
+// Header at the start of a journal file, identifying the file it applies to.
+struct journalHdr {
+  char magic[8];            // "KILOJNL1".
+  long long size;           // Size of the file when the journal was started.
+  long long mtime;          // Modification time of that file in nanoseconds.
+};
+
+// Struct to represent the crash-recovery journal of the open file.
+struct editorJournal {
+  int fd;                   // Journal file descriptor, -1 when none is open.
+  char *path;               // Path of the journal file.
+  char *buf;                // Records not yet written to the journal file.
+  size_t len;               // Number of pending bytes in buf.
+  size_t cap;               // Allocated size of buf.
+  int unsynced;             // Set when records were written but not yet synced.
+  long long last_flush;     // Monotonic time of the last fsync in milliseconds.
+};
+
 // Struct to represent the editor's configuration and state.
 struct editorConfig {
   int cx, cy;               // Current cursor position (x, y) in characters.
   int rx;                   // Current cursor position in render (used for tabs).
   int rowoff;               // Offset of the top visible row in the text.
   int coloff;               // Offset of the leftmost visible column in the text.
-  int screenrows;           // Number of rows visible on the screen.
-  int screencols;           // Number of columns visible on the screen.
+  int screenrows;           // Number of text rows of the focused pane.
+  int screencols;           // Number of columns of the focused pane.
   int numrows;              // Total number of rows in the editor.
   erow *row;                // Array of erow structs to store the text rows.
   int dirty;                // Flag to indicate if there are unsaved changes.
@@ -71,11 +266,98 @@ struct editorConfig {
   time_t statusmsg_time;    // Time at which the status message was set.
   struct editorSyntax *syntax; // Pointer to the syntax highlighting rules for the current file type.
   struct termios orig_termios; // Original terminal settings for the editor.
+  struct editorTrigramIndex tri; // Trigram index used to speed up searches.
+  struct editorLineIndex lines; // Byte offsets of the rows.
+  struct editorUndo undo;   // Undo/redo journal of the buffer.
+  struct editorJournal journal; // Crash-recovery journal of the file.
+  int batch;                // Running headless from a script or replay, without a terminal.
+  struct rowPool pool;      // Allocator for the row buffers of this file.
+  struct editorLoader load; // Rest of the file while it loads in the background.
+  struct editorRaw raw;     // Read-only view of a binary or huge-line file, used instead of rows.
+  struct editorFollow follow; // Appending new lines of a growing file.
+  struct editorDisk disk;   // State of the file on disk as last seen.
+  int codec;                // Compression of the file on disk, CODEC_NONE if plain.
+  int damaged;              // Set when only part of a compressed file could be read.
+  int undecoded;            // Compression of a file loaded undecoded; it can't be saved over.
+  long long used;           // Buffer clock when this buffer was last left.
+  int compact;              // Set once render text and highlighting were dropped.
+  int wrap;                 // Soft wrap long rows in the focused pane.
+  int subrow;               // Visual line of row rowoff at the top while wrapping.
 };
 
 // Global instance of the editor configuration.
 struct editorConfig E;
 
+// Struct to represent where keypresses come from and where frames go.
+struct editorInput {
+  FILE *record;             // Log of raw input bytes being recorded, or NULL.
+  long long start_ns;       // Time the recording or replay started.
+  char *replay;             // Input bytes being replayed, or NULL.
+  size_t replay_len;        // Number of bytes in replay.
+  size_t replay_pos;        // Next byte to hand to editorReadKey.
+  long long *replay_us;     // Recorded time of each replayed byte in microseconds.
+  int replay_waited;        // Set once the read timeout before the next byte was given.
+  int done;                 // Set when the replayed session quit.
+  int outfd;                // Where editorRefreshScreen writes frames.
+  long long key_ns;         // When the key awaiting a frame was read, or 0.
+  long long *lat;           // Keystroke-to-frame latencies in nanoseconds.
+  size_t nlat;              // Number of latencies measured.
+  size_t latcap;            // Allocated size of lat.
+  int busy;                 // Set while a keypress is handled; see editorScroll.
+};
+
+// Global instance of the input source state.
+struct editorInput In = { NULL, 0, NULL, 0, 0, NULL, 0, 0, STDOUT_FILENO, 0, NULL, 0, 0, 0 };
+
+// Struct to represent the list of open files. The current buffer lives in
+// E; its slot is only written back when another buffer is switched to.
+struct editorBuffers {
+  struct editorConfig *buf; // Every open buffer, in the order they were opened.
+  int len;                  // Number of slots in use, 0 until a second file is opened.
+  int cur;                  // Slot of the buffer that is in E.
+  long long clock;          // Counts switches, for least-recently-used eviction.
+};
+
+// Global instance of the buffer list.
+struct editorBuffers B = { NULL, 0, 0, 0 };
+
+// Struct to represent one pane of the screen and the buffer it shows.
+struct editorView {
+  int buf;                  // Slot of the buffer shown, see editorBuffers.
+  int cx, cy;               // Cursor position while the pane is not focused.
+  int rowoff, coloff;       // Scroll position while the pane is not focused.
+  int subrow;               // Visual line of row rowoff at the top while wrapping.
+  int wrap;                 // Set when the pane soft wraps long rows.
+  int top, left;            // Screen position of the pane's first text row.
+  int rows, cols;           // Text rows (its status bar is below) and columns.
+  unsigned long long *drawn; // Hash of each line as last written, rows + 1 of them.
+};
+
+// Struct to represent how the screen is divided into panes. The focused
+// pane's cursor and scroll position live in E.
+struct editorViews {
+  struct editorView *v;     // Every pane; together they tile the screen.
+  int len;                  // Number of panes, 0 until the first frame.
+  int cur;                  // Pane with the keyboard focus.
+  int rows, cols;           // Screen size above the message bar.
+};
+
+// Global instance of the screen layout.
+struct editorViews V = { NULL, 0, 0, 0, 0 };
+
+// Struct to represent the search in progress. The match is highlighted in
+// the row itself, so the row's own highlighting is kept to be put back.
+struct editorSearch {
+  int last_match;           // Row of the last match, or -1.
+  int direction;            // 1 to search forward, -1 backward.
+  int saved_hl_line;        // Row whose highlighting saved_hl holds.
+  int saved_hl_len;         // Rendered size of that row when it was saved.
+  unsigned char *saved_hl;  // Its highlighting before the match, or NULL.
+};
+
+// Global instance of the search state.
+struct editorSearch S = { -1, 1, 0, 0, NULL };
+
 /*** filetypes ***/
 
 // Array of file extensions supported for C/C++ syntax highlighting.
@@ -114,6 +396,95 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptText(char *prompt, void (*callback)(char *, int), int allow_empty);
+int editorUndoLost();
+int editorTriIndexStep();
+void editorUndoRecord(int row, int col, char *old, int oldlen, char *new, int newlen);
+void editorUndoRecordRow(int type, int at, char *s, int len);
+void editorJournalRecord(undoRec *h, char *new);
+void editorJournalTick();
+void editorFollowTick();
+void editorFollowSync();
+void editorDiskTick();
+void editorDiskSync();
+int editorDiskChanged();
+void editorLoadCancel();
+void editorLoadUntil(int at);
+void editorLoadFinish();
+int editorLoadStep(size_t max);
+void editorFindDrop();
+void editorFindEnd();
+int editorLineSpan(const char *p, const char *end, const char **next);
+int editorRowIs(erow *row, const char *s, int len);
+int editorWriteAll(int fd, const char *s, size_t len);
+void editorRowLayout(struct rowPool *pool, erow *row);
+char *editorRowRender(erow *row);
+void initEditor();
+long long editorNowNs();
+
+/*** profiling ***/
+
+// Frame profiling is only compiled in with -DKILO_PROFILE (make kilo-profile).
+#ifdef KILO_PROFILE
+
+// This enum defines the timed phases of a frame.
+enum editorProfPhase {
+  PROF_SCROLL = 0,   // editorScroll
+  PROF_DRAW,         // editorDrawRows
+  PROF_HIGHLIGHT,    // editorUpdateSyntax, including its cascade
+  PROF_WRITE,        // write() of the finished frame
+  PROF_PHASES
+};
+
+// Struct to hold the counters of one frame.
+struct profFrame {
+  long long ns[PROF_PHASES]; // Time spent in each phase.
+  long long bytes;          // Bytes written to the terminal.
+  long long rows_hl;        // Rows whose highlighting was recomputed.
+  long long allocs;         // malloc/realloc/calloc calls.
+};
+
+// Struct to represent the profiler state.
+struct editorProfile {
+  struct profFrame cur;     // Counters of the frame being built.
+  struct profFrame last;    // Counters of the last frame flushed.
+  int overlay;              // Show the last frame in the message bar.
+};
+
+struct editorProfile P;
+
+// Counters of the calling thread when set, instead of P.cur. Loader
+// threads count per chunk, and editorLoadRun adds the totals once they are
+// joined, so no counter is shared between threads.
+__thread struct profFrame *prof_thread;
+
+#define PROF_BEGIN(phase) long long prof_##phase = editorNowNs()
+#define PROF_END(phase) (P.cur.ns[phase] += editorNowNs() - prof_##phase)
+#define PROF_COUNT(field, n) ((prof_thread ? prof_thread : &P.cur)->field += (n))
+#define PROF_THREAD(frame) (prof_thread = (frame))
+#define PROF_MERGE(frame) (PROF_COUNT(allocs, (frame)->allocs), \
+                           PROF_COUNT(rows_hl, (frame)->rows_hl), \
+                           memset((frame), 0, sizeof(*(frame))))
+
+// Allocation wrappers; the macros below route the rest of the file here.
+// Row buffers are counted once where the pool hands them out, so the pool
+// calls the plain functions, as (malloc)(n).
+void *editorProfMalloc(size_t n) { PROF_COUNT(allocs, 1); return malloc(n); }
+void *editorProfRealloc(void *p, size_t n) { PROF_COUNT(allocs, 1); return realloc(p, n); }
+void *editorProfCalloc(size_t n, size_t m) { PROF_COUNT(allocs, 1); return calloc(n, m); }
+#define malloc(n) editorProfMalloc(n)
+#define realloc(p, n) editorProfRealloc(p, n)
+#define calloc(n, m) editorProfCalloc(n, m)
+
+#else
+
+#define PROF_BEGIN(phase)
+#define PROF_END(phase)
+#define PROF_COUNT(field, n)
+#define PROF_THREAD(frame)
+#define PROF_MERGE(frame)
+
+#endif
 
 /*** terminal ***/
 
@@ -148,34 +519,75 @@ void enableRawMode() {
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = KILO_READ_TIMEOUT_MS / 100;
 
   // Apply the modified settings to the terminal.
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
+// Function to check whether a keypress is waiting on stdin without blocking.
+int editorInputPending() {
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  return poll(&pfd, 1, 0) > 0;
+}
+
+// Function to read one raw input byte, from the terminal or a replay log.
+// Returns 1 when a byte was read and 0 on timeout, like read().
+int editorReadByte(char *c) {
+  if (In.replay) {
+    if (In.replay_pos == In.replay_len) return 0;
+    // A byte that came after the read timeout was preceded by a timed out
+    // read in the recorded session, which ends an escape sequence there.
+    size_t i = In.replay_pos;
+    if (i > 0 && !In.replay_waited &&
+        In.replay_us[i] - In.replay_us[i - 1] >= KILO_READ_TIMEOUT_MS * 1000) {
+      In.replay_waited = 1;
+      return 0;
+    }
+    In.replay_waited = 0;
+    *c = In.replay[In.replay_pos++];
+    return 1;
+  }
+
+  int nread = read(STDIN_FILENO, c, 1);
+  if (nread == 1 && In.record) {
+    fprintf(In.record, "%lld %d\n", (editorNowNs() - In.start_ns) / 1000,
+            (unsigned char)*c);
+  }
+  return nread;
+}
+
 // Function to read a keypress from the user.
 int editorReadKey() {
   int nread;
   char c;
 
   // Keep reading until a keypress is received.
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  while ((nread = editorReadByte(&c)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    // An exhausted replay reads as escape presses, which back out of prompts.
+    if (In.replay && In.replay_pos == In.replay_len) {
+      c = '\x1b';
+      break;
+    }
+    editorJournalTick();
   }
 
+  // Start the keystroke-to-frame clock when replaying.
+  if (In.replay && In.key_ns == 0) In.key_ns = editorNowNs();
+
   // Handle escape sequences for special keys.
   if (c == '\x1b') {
     char seq[3];
 
     // Read additional characters for escape sequences.
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     // Process different escape sequences and map them to key constants.
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
@@ -206,7 +618,34 @@ int editorReadKey() {
 
     return '\x1b'; // Return escape character if no special sequence is matched.
   } else {
-    return c; // Return the regular character.
+    // Bytes of UTF-8 characters come through as values up to 255.
+    return (unsigned char)c; // Return the regular character.
+  }
+}
+
+// Function to do the background work while no key is waiting: following
+// the file, noticing changes on disk, finishing the load and extending the
+// search index. It is only called from the main loop between keypresses,
+// never while a prompt or a command waits for a key, because it can
+// replace or reallocate the rows those hold on to.
+void editorIdle() {
+  if (In.replay) return;
+  while (!editorInputPending()) {
+    editorJournalTick();
+    editorFollowTick();
+    editorDiskTick();
+    // Finish loading the file, showing progress as it goes.
+    if (E.load.data) {
+      while (!editorInputPending() && editorLoadStep(E.load.step))
+        editorRefreshScreen();
+      editorRefreshScreen();
+      continue;
+    }
+    while (editorTriIndexStep() && !editorInputPending());
+
+    // Nothing left to do until the next key or tick.
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    poll(&pfd, 1, 100);
   }
 }
 
@@ -233,23 +672,288 @@ int getCursorPosition(int *rows, int *cols) {
   return 0;
 }
 
-// Function to retrieve
+// Function to retrieve the size of the terminal window.
+int getWindowSize(int *rows, int *cols) {
+  struct winsize ws;
+
+  // Fall back to moving the cursor to the far corner and asking for its position.
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+    return getCursorPosition(rows, cols);
+  } else {
+    *cols = ws.ws_col;
+    *rows = ws.ws_row;
+    return 0;
+  }
+}
+
+/*** row allocator ***/
+
+// Chunks shared by the pools of every buffer.
+struct rowSpare Spare = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+// Block sizes of the slab classes, including the 8-byte header.
+const unsigned int slabClassSize[SLAB_CLASSES] = {
+  16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+  3072, 4096
+};
+
+// Function to find the smallest slab class holding n payload bytes.
+int editorSlabClass(size_t n) {
+  static unsigned char lookup[KILO_SLAB_MAX / 8 + 1];
+  static int ready = 0;
+  if (!ready) {
+    int c = 0;
+    for (int j = 0; j <= KILO_SLAB_MAX / 8; j++) {
+      while (slabClassSize[c] < (unsigned int)j * 8) c++;
+      lookup[j] = c;
+    }
+    ready = 1;
+  }
+  size_t need = n + 8;
+  if (need > KILO_SLAB_MAX) return SLAB_BIG;
+  return lookup[(need + 7) / 8];
+}
+
+// Function to get a buffer of at least n bytes from a pool.
+void *editorPoolAlloc(struct rowPool *pool, size_t n) {
+  int cls = editorSlabClass(n);
+  PROF_COUNT(allocs, 1);
+
+  if (cls == SLAB_BIG) {
+    slabBig *b = (malloc)(sizeof(slabBig) + n);
+    pool->bytes += sizeof(slabBig) + n;
+    b->size = n;
+    b->cls = SLAB_BIG;
+    b->prev = NULL;
+    b->next = pool->big;
+    if (pool->big) pool->big->prev = b;
+    pool->big = b;
+    return b + 1;
+  }
+
+  char *block;
+  if (pool->free[cls]) {
+    block = (char *)pool->free[cls] - 8;
+    pool->free[cls] = *(void **)pool->free[cls];
+  } else {
+    unsigned int size = slabClassSize[cls];
+    if (pool->left < size) {
+      // The tail of the old chunk is abandoned; it is at most one block.
+      pthread_mutex_lock(&Spare.lock);
+      char *chunk = Spare.chunks;
+      if (chunk) {
+        Spare.chunks = *(char **)chunk;
+        Spare.count--;
+      }
+      pthread_mutex_unlock(&Spare.lock);
+      if (chunk == NULL) chunk = (malloc)(KILO_SLAB_CHUNK);
+      pool->bytes += KILO_SLAB_CHUNK;
+      *(char **)chunk = pool->chunks;
+      pool->chunks = chunk;
+      pool->cur = chunk + 8;
+      pool->left = KILO_SLAB_CHUNK - 8;
+    }
+    block = pool->cur;
+    pool->cur += size;
+    pool->left -= size;
+  }
+  ((unsigned int *)block)[1] = cls;
+  return block + 8;
+}
+
+// Function to read how many bytes a row buffer can hold.
+size_t editorRowCapacity(void *p) {
+  unsigned int cls = ((unsigned int *)p)[-1];
+  if (cls == SLAB_BIG) return ((slabBig *)p - 1)->size;
+  return slabClassSize[cls] - 8;
+}
+
+// Function to return a buffer to the pool it came from.
+void editorPoolFree(struct rowPool *pool, void *p) {
+  if (p == NULL) return;
+  unsigned int cls = ((unsigned int *)p)[-1];
+
+  if (cls == SLAB_BIG) {
+    slabBig *b = (slabBig *)p - 1;
+    if (b->prev) b->prev->next = b->next;
+    else pool->big = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pool->bytes -= sizeof(slabBig) + b->size;
+    free(b);
+    return;
+  }
+  *(void **)p = pool->free[cls];
+  pool->free[cls] = p;
+}
+
+// Function to resize a pool buffer, keeping its contents. Blocks are only
+// moved when the new size doesn't fit their size class.
+void *editorPoolRealloc(struct rowPool *pool, void *p, size_t n) {
+  if (p == NULL) return editorPoolAlloc(pool, n);
+  size_t cap = editorRowCapacity(p);
+  if (n <= cap && editorSlabClass(n) == (int)((unsigned int *)p)[-1]) return p;
+
+  void *q = editorPoolAlloc(pool, n);
+  memcpy(q, p, n < cap ? n : cap);
+  editorPoolFree(pool, p);
+  return q;
+}
+
+// Function to get a row buffer of at least n bytes from the buffer's pool.
+void *editorRowAlloc(size_t n) {
+  return editorPoolAlloc(&E.pool, n);
+}
+
+// Function to return a row buffer to the buffer's pool.
+void editorRowFree(void *p) {
+  editorPoolFree(&E.pool, p);
+}
+
+// Function to resize a row buffer from the buffer's pool.
+void *editorRowRealloc(void *p, size_t n) {
+  return editorPoolRealloc(&E.pool, p, n);
+}
+
+// Function to move every buffer of one pool into another, leaving src empty.
+void editorRowPoolMerge(struct rowPool *dst, struct rowPool *src) {
+  if (src->chunks) {
+    char *tail = src->chunks;
+    while (*(char **)tail) tail = *(char **)tail;
+    *(char **)tail = dst->chunks;
+    dst->chunks = src->chunks;
+  }
+  if (src->big) {
+    slabBig *tail = src->big;
+    while (tail->next) tail = tail->next;
+    tail->next = dst->big;
+    if (dst->big) dst->big->prev = tail;
+    dst->big = src->big;
+  }
+  for (int c = 0; c < SLAB_CLASSES; c++) {
+    void **p = &src->free[c];
+    if (*p == NULL) continue;
+    while (*p) p = (void **)*p;
+    *p = dst->free[c];
+    dst->free[c] = src->free[c];
+  }
+  // Keep carving from whichever chunk has more room left.
+  if (src->left > dst->left) {
+    dst->cur = src->cur;
+    dst->left = src->left;
+  }
+  dst->bytes += src->bytes;
+  memset(src, 0, sizeof(*src));
+}
+
+// Function to release every row buffer of the pool at once. Its chunks
+// are kept for other pools, up to KILO_SPARE_CHUNKS.
+void editorRowPoolRelease(struct rowPool *pool) {
+  pthread_mutex_lock(&Spare.lock);
+  while (pool->chunks) {
+    char *next = *(char **)pool->chunks;
+    if (Spare.count < KILO_SPARE_CHUNKS) {
+      *(char **)pool->chunks = Spare.chunks;
+      Spare.chunks = pool->chunks;
+      Spare.count++;
+    } else {
+      free(pool->chunks);
+    }
+    pool->chunks = next;
+  }
+  pthread_mutex_unlock(&Spare.lock);
+  while (pool->big) {
+    slabBig *next = pool->big->next;
+    free(pool->big);
+    pool->big = next;
+  }
+  memset(pool, 0, sizeof(*pool));
+}
+
 /*** syntax highlighting ***/
 
 // Function to check if a character is a separator (whitespace or specific characters).
 int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return isspace((unsigned char)c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-// Function to update syntax highlighting for a row of text.
-void editorUpdateSyntax(erow *row) {
-  // Resize the row's syntax highlight array and initialize it with HL_NORMAL.
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+// Function to get a scratch buffer of at least n highlight bytes. It is
+// shared by the highlighter and the screen drawing code.
+unsigned char *editorHlScratch(int n) {
+  static unsigned char *buf = NULL;
+  static int cap = 0;
+  if (n > cap) {
+    cap = n > 2 * cap ? n : 2 * cap;
+    buf = realloc(buf, cap);
+  }
+  return buf;
+}
+
+// Function to store the highlighting of a row after its render text. Runs
+// of one class are kept as (class, length) pairs whenever that is smaller.
+// The row's block is grown from pool if needed.
+void editorRowHlStore(struct rowPool *pool, erow *row, unsigned char *hl) {
+  int runs = 0;
+  for (int i = 0; i < row->rsize; runs++) {
+    int j = i + 1;
+    while (j < row->rsize && j - i < 255 && hl[j] == hl[i]) j++;
+    i = j;
+  }
+  int rle = 2 * runs < row->rsize;
+  size_t len = rle ? 2 * runs : row->rsize;
+
+  size_t roff = row->render - row->chars;
+  size_t need = roff + row->rsize + 1 + len;
+  if (editorRowCapacity(row->chars) < need) {
+    row->chars = editorPoolRealloc(pool, row->chars, need);
+    row->render = &row->chars[roff];
+  }
+  row->hl = (unsigned char *)&row->render[row->rsize + 1];
+  row->hl_runs = rle ? runs : 0;
+  if (!rle) {
+    memcpy(row->hl, hl, row->rsize);
+    return;
+  }
+
+  unsigned char *out = row->hl;
+  for (int i = 0; i < row->rsize;) {
+    int j = i + 1;
+    while (j < row->rsize && j - i < 255 && hl[j] == hl[i]) j++;
+    *out++ = hl[i];
+    *out++ = j - i;
+    i = j;
+  }
+}
 
-  // If no syntax highlighting rules are defined, return.
-  if (E.syntax == NULL) return;
+// Function to expand len highlight bytes of a row starting at column from.
+void editorRowHlSlice(erow *row, int from, int len, unsigned char *out) {
+  if (row->hl_runs == 0) {
+    memcpy(out, &row->hl[from], len);
+    return;
+  }
+  unsigned char *run = row->hl;
+  unsigned char *end = row->hl + 2 * row->hl_runs;
+  int at = 0;
+  while (run < end && at + run[1] <= from) {
+    at += run[1];
+    run += 2;
+  }
+  int n = 0;
+  while (n < len && run < end) {
+    int take = at + run[1] - (from + n);
+    if (take > len - n) take = len - n;
+    memset(&out[n], run[0], take);
+    n += take;
+    at += run[1];
+    run += 2;
+  }
+}
 
+// Function to highlight rendered text into hl, which must be filled with
+// HL_NORMAL, using the current syntax rules. in_comment tells if the text
+// starts inside a multi-line comment; the state at the end of the text is
+// returned. render must be followed by a NUL byte.
+int editorHighlight(char *render, int rsize, int in_comment, unsigned char *hl) {
   // Extract syntax highlighting rules and settings.
   char **keywords = E.syntax->keywords;
   char *scs = E.syntax->singleline_comment_start;
@@ -260,17 +964,16 @@ void editorUpdateSyntax(erow *row) {
   int mce_len = mce ? strlen(mce) : 0;
   int prev_sep = 1;
   int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
 
   int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+  while (i < rsize) {
+    char c = render[i];
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
     // Handle single-line comments.
     if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+      if (!strncmp(&render[i], scs, scs_len)) {
+        memset(&hl[i], HL_COMMENT, rsize - i);
         break;
       }
     }
@@ -278,9 +981,9 @@ void editorUpdateSyntax(erow *row) {
     // Handle multi-line comments.
     if (mcs_len && mce_len && !in_string) {
       if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+        hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&render[i], mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len;
           in_comment = 0;
           prev_sep = 1;
@@ -289,8 +992,8 @@ void editorUpdateSyntax(erow *row) {
           i++;
           continue;
         }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+      } else if (!strncmp(&render[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
         i += mcs_len;
         in_comment = 1;
         continue;
@@ -300,9 +1003,9 @@ void editorUpdateSyntax(erow *row) {
     // Handle string literals with escape sequences.
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < rsize) {
+          hl[i + 1] = HL_STRING;
           i += 2;
           continue;
         }
@@ -313,7 +1016,7 @@ void editorUpdateSyntax(erow *row) {
       } else {
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          hl[i] = HL_STRING;
           i++;
           continue;
         }
@@ -322,9 +1025,9 @@ void editorUpdateSyntax(erow *row) {
 
     // Handle numeric literals.
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+      if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        hl[i] = HL_NUMBER;
         i++;
         prev_sep = 0;
         continue;
@@ -339,9 +1042,9 @@ void editorUpdateSyntax(erow *row) {
         int kw2 = keywords[j][klen - 1] == '|';
         if (kw2) klen--;
 
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+        if (!strncmp(&render[i], keywords[j], klen) &&
+            is_separator(render[i + klen])) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
           i += klen;
           break;
         }
@@ -355,12 +1058,36 @@ void editorUpdateSyntax(erow *row) {
     prev_sep = is_separator(c);
     i++;
   }
+  return in_comment;
+}
+
+// Function to update syntax highlighting for a row of text.
+void editorUpdateSyntax(erow *row) {
+  for (;;) {
+    PROF_COUNT(rows_hl, 1);
+    // Rows of a compacted buffer get their render text back first.
+    if (row->render == NULL) editorRowLayout(&E.pool, row);
+    // Highlight into scratch space initialized with HL_NORMAL; the row keeps a compact copy.
+    unsigned char *hl = editorHlScratch(row->rsize);
+    memset(hl, HL_NORMAL, row->rsize);
+
+    // If no syntax highlighting rules are defined, return.
+    if (E.syntax == NULL) {
+      editorRowHlStore(&E.pool, row, hl);
+      return;
+    }
+
+    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    in_comment = editorHighlight(row->render, row->rsize, in_comment, hl);
+    editorRowHlStore(&E.pool, row, hl);
 
-  // Update the row's open comment state and trigger updates for subsequent rows if needed.
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+    // Update the row's open comment state and carry on with the next row if
+    // it changed. This is a loop so long comment cascades don't recurse.
+    int changed = (row->hl_open_comment != in_comment);
+    row->hl_open_comment = in_comment;
+    if (!changed || row->idx + 1 >= E.numrows) return;
+    row = &E.row[row->idx + 1];
+  }
 }
 
 // Function to map a syntax highlight type to a terminal color.
@@ -395,15 +1122,20 @@ void editorSelectSyntaxHighlight() {
       if (p != NULL) {
         int patlen = strlen(s->filematch[i]);
 
-        // Check if the match is exact or if it occurs at the end of the filename.
-        if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
+        // Check if the match is exact or if it occurs at the end of the
+        // filename, not counting a compression suffix.
+        const char *rest = p + patlen;
+        if (s->filematch[i][0] != '.' || *rest == '\0' || !strcmp(rest, ".gz") ||
+            !strcmp(rest, ".zst")) {
           E.syntax = s;
 
           // Update syntax highlighting for all rows in the editor.
           int filerow;
+          PROF_BEGIN(PROF_HIGHLIGHT);
           for (filerow = 0; filerow < E.numrows; filerow++) {
             editorUpdateSyntax(&E.row[filerow]);
           }
+          PROF_END(PROF_HIGHLIGHT);
 
           return;
         }
@@ -413,368 +1145,3755 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
+/*** search index ***/
 
-/*** row operations ***/
+// Function to hash three rendered characters into a trigram bucket number.
+unsigned int editorTriHash(const char *p) {
+  unsigned int t = ((unsigned char)p[0] << 16) | ((unsigned char)p[1] << 8) |
+                   (unsigned char)p[2];
+  return (t * 2654435761u) >> (32 - KILO_TRI_BITS);
+}
 
-// Function to convert the character index (cx) to the visual index (rx) for rendering.
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+// Function to release the trigram index and any cached query results.
+void editorTriIndexFree() {
+  if (E.tri.buckets) {
+    for (int j = 0; j < (1 << KILO_TRI_BITS); j++) free(E.tri.buckets[j].blocks);
   }
-  return rx;
+  free(E.tri.buckets);
+  free(E.tri.first);
+  free(E.tri.touched);
+  free(E.tri.query);
+  free(E.tri.cand);
+  memset(&E.tri, 0, sizeof(E.tri));
 }
 
-// Function to convert the visual index (rx) to the character index (cx).
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
+// Function to find the first position in a sorted array holding a value >= v.
+int editorLowerBound(int *a, int len, int v) {
+  int lo = 0, hi = len;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (a[mid] < v) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-    if (cur_rx > rx) return cx;
+// Function to add a block number to a posting list, keeping it sorted.
+void editorTriPostAdd(tripost *p, int block) {
+  int pos = p->len;
+  // Blocks are mostly added in ascending order, so check the end first.
+  if (pos && p->blocks[pos - 1] >= block) {
+    pos = editorLowerBound(p->blocks, p->len, block);
+    if (p->blocks[pos] == block) return;
   }
-  return cx;
+  if (p->len == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 4;
+    p->blocks = realloc(p->blocks, sizeof(int) * p->cap);
+  }
+  memmove(&p->blocks[pos + 1], &p->blocks[pos], sizeof(int) * (p->len - pos));
+  p->blocks[pos] = block;
+  p->len++;
 }
 
-// Function to update the rendered version of a row.
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+// Function to add the trigrams of one row to the posting lists of a block.
+void editorTriIndexRow(int r, int block) {
+  erow *row = &E.row[r];
+  char *render = editorRowRender(row);
+  for (int i = 0; i + 2 < row->rsize; i++)
+    editorTriPostAdd(&E.tri.buckets[editorTriHash(&render[i])], block);
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+// Function to index the next slice of rows; returns 1 while work remains.
+int editorTriIndexStep() {
+  if (E.tri.buckets == NULL) {
+    if (E.numrows < KILO_TRI_MIN_ROWS) return 0;
+    E.tri.buckets = calloc(1 << KILO_TRI_BITS, sizeof(tripost));
+    E.tri.blockcap = 1024;
+    E.tri.first = malloc(sizeof(int) * E.tri.blockcap);
+    E.tri.first[0] = 0;
+  }
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+  // Only whole blocks are indexed; the partial tail is scanned linearly.
+  int done = 0;
+  while (E.tri.built + KILO_TRI_BLOCK <= E.numrows && done < KILO_TRI_STEP_ROWS) {
+    int block = E.tri.nblocks;
+    if (block + 2 > E.tri.blockcap) {
+      E.tri.blockcap *= 2;
+      E.tri.first = realloc(E.tri.first, sizeof(int) * E.tri.blockcap);
     }
+    for (int r = E.tri.built; r < E.tri.built + KILO_TRI_BLOCK; r++)
+      editorTriIndexRow(r, block);
+    E.tri.built += KILO_TRI_BLOCK;
+    E.tri.first[++E.tri.nblocks] = E.tri.built;
+    done += KILO_TRI_BLOCK;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  if (done) E.tri.gen++;
+  return E.tri.built + KILO_TRI_BLOCK <= E.numrows;
+}
 
-  // Update syntax highlighting for the row.
-  editorUpdateSyntax(row);
+// Function to find the indexed block that row 'at' belongs to.
+int editorTriIndexBlockOf(int at) {
+  int b = editorLowerBound(E.tri.first, E.tri.nblocks + 1, at + 1) - 1;
+  return b < 0 ? 0 : b;
 }
 
-// Function to insert a new row at a specific position.
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
+// Function to drop index coverage of every row from 'at' onwards. Only
+// used when so many rows changed at once that indexing them again is
+// cheaper than tracking them.
+void editorTriIndexTruncate(int at) {
+  if (E.tri.buckets == NULL || at >= E.tri.built) return;
+
+  int block = editorTriIndexBlockOf(at);
+  for (int j = 0; j < (1 << KILO_TRI_BITS); j++) {
+    tripost *p = &E.tri.buckets[j];
+    if (p->len && p->blocks[p->len - 1] >= block)
+      p->len = editorLowerBound(p->blocks, p->len, block);
+  }
+  E.tri.nblocks = block;
+  E.tri.built = E.tri.first[block];
+  E.tri.ntouched = editorLowerBound(E.tri.touched, E.tri.ntouched, E.tri.built);
+  E.tri.gen++;
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+// Function to move the index over n rows inserted at 'at'. They join the
+// block they land in; laying them out marks them as edited.
+void editorTriIndexInsert(int at, int n) {
+  if (E.tri.buckets == NULL || at >= E.tri.built || n <= 0) return;
+  if (n > KILO_TRI_MAX_TOUCHED) {
+    editorTriIndexTruncate(at);
+    return;
+  }
+
+  for (int b = editorTriIndexBlockOf(at) + 1; b <= E.tri.nblocks; b++)
+    E.tri.first[b] += n;
+  E.tri.built += n;
+  for (int t = editorLowerBound(E.tri.touched, E.tri.ntouched, at); t < E.tri.ntouched; t++)
+    E.tri.touched[t] += n;
+  E.tri.gen++;
+}
 
-  E.row[at].idx = at;
+// Function to move the index over n rows deleted at 'at'. Their trigrams
+// stay in the postings, which only costs a row or two of extra scanning.
+void editorTriIndexDelete(int at, int n) {
+  if (E.tri.buckets == NULL || at >= E.tri.built || n <= 0) return;
+
+  int end = at + n < E.tri.built ? at + n : E.tri.built;
+  for (int b = editorTriIndexBlockOf(at) + 1; b <= E.tri.nblocks; b++)
+    E.tri.first[b] = E.tri.first[b] >= end ? E.tri.first[b] - (end - at) : at;
+  E.tri.built -= end - at;
+
+  int lo = editorLowerBound(E.tri.touched, E.tri.ntouched, at);
+  int hi = editorLowerBound(E.tri.touched, E.tri.ntouched, end);
+  for (int t = hi; t < E.tri.ntouched; t++)
+    E.tri.touched[lo + t - hi] = E.tri.touched[t] - (end - at);
+  E.tri.ntouched -= hi - lo;
+  E.tri.gen++;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+// Function to add the trigrams of every edited row to the block holding
+// it, so they no longer have to be scanned on every search.
+void editorTriIndexMerge() {
+  for (int t = 0; t < E.tri.ntouched; t++) {
+    int r = E.tri.touched[t];
+    editorTriIndexRow(r, editorTriIndexBlockOf(r));
+  }
+  E.tri.ntouched = 0;
+  E.tri.gen++;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+// Function to note that an already indexed row changed its contents.
+void editorTriIndexTouch(int at) {
+  if (E.tri.buckets == NULL || at >= E.tri.built) return;
 
-  E.numrows++;
-  E.dirty++;
+  int pos = editorLowerBound(E.tri.touched, E.tri.ntouched, at);
+  if (pos < E.tri.ntouched && E.tri.touched[pos] == at) return;
+
+  // Too many edited rows: fold them into their blocks.
+  if (E.tri.ntouched == KILO_TRI_MAX_TOUCHED) {
+    editorTriIndexMerge();
+    pos = 0;
+  }
+
+  if (E.tri.touched == NULL)
+    E.tri.touched = malloc(sizeof(int) * KILO_TRI_MAX_TOUCHED);
+  memmove(&E.tri.touched[pos + 1], &E.tri.touched[pos],
+          sizeof(int) * (E.tri.ntouched - pos));
+  E.tri.touched[pos] = at;
+  E.tri.ntouched++;
+  E.tri.gen++;
 }
 
-// Function to free memory associated with a row.
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// Function to collect the rows that may contain query, in ascending order.
+// Returns -1 when the index can't help and every row has to be scanned.
+int editorTriIndexCandidates(char *query, int **out) {
+  int qlen = strlen(query);
+  if (E.tri.buckets == NULL || E.tri.built == 0 || qlen < 3) return -1;
+
+  *out = E.tri.cand;
+  if (E.tri.query && E.tri.query_gen == E.tri.gen && !strcmp(E.tri.query, query))
+    return E.tri.ncand;
+
+  // Gather the distinct posting lists of the query, starting from the shortest.
+  int nlists = 0;
+  tripost **lists = malloc(sizeof(tripost *) * (qlen - 2));
+  for (int i = 0; i + 2 < qlen; i++) {
+    tripost *p = &E.tri.buckets[editorTriHash(&query[i])];
+    int j;
+    for (j = 0; j < nlists && lists[j] != p; j++);
+    if (j < nlists) continue;
+    lists[nlists++] = p;
+    if (p->len < lists[0]->len) {
+      lists[nlists - 1] = lists[0];
+      lists[0] = p;
+    }
+  }
+
+  int cap = E.tri.ntouched + (E.numrows - E.tri.built);
+  for (int b = 0; b < lists[0]->len; b++)
+    cap += E.tri.first[lists[0]->blocks[b] + 1] - E.tri.first[lists[0]->blocks[b]];
+  int *cand = malloc(sizeof(int) * (cap ? cap : 1));
+  int ncand = 0;
+  int t = 0;
+
+  // Intersect the block lists and merge in the edited rows along the way.
+  for (int b = 0; b < lists[0]->len; b++) {
+    int block = lists[0]->blocks[b];
+    int j;
+    for (j = 1; j < nlists; j++) {
+      int pos = editorLowerBound(lists[j]->blocks, lists[j]->len, block);
+      if (pos == lists[j]->len || lists[j]->blocks[pos] != block) break;
+    }
+    if (j < nlists) continue;
+
+    for (int r = E.tri.first[block]; r < E.tri.first[block + 1]; r++) {
+      while (t < E.tri.ntouched && E.tri.touched[t] < r)
+        cand[ncand++] = E.tri.touched[t++];
+      if (t < E.tri.ntouched && E.tri.touched[t] == r) t++;
+      cand[ncand++] = r;
+    }
+  }
+  while (t < E.tri.ntouched) cand[ncand++] = E.tri.touched[t++];
+
+  // Rows past the indexed prefix are always candidates.
+  for (int r = E.tri.built; r < E.numrows; r++) cand[ncand++] = r;
+  free(lists);
+
+  free(E.tri.query);
+  free(E.tri.cand);
+  E.tri.query = strdup(query);
+  E.tri.query_gen = E.tri.gen;
+  E.tri.cand = cand;
+  E.tri.ncand = ncand;
+  *out = cand;
+  return ncand;
 }
 
-// Function to delete a row at a specific position.
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+/*** line index ***/
+
+// Function to drop the line index.
+void editorLineIndexFree() {
+  free(E.lines.tree);
+  memset(&E.lines, 0, sizeof(E.lines));
 }
 
-// Function to insert a character into a row at a specific position.
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Function to note that rows from 'at' on were inserted, deleted or moved.
+void editorLineIndexTruncate(int at) {
+  if (E.lines.valid > at) E.lines.valid = at;
 }
 
-// Function to append a string to the end of a row.
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Function to bring the line index up to date with the rows. Only nodes
+// past the first invalidated row are rebuilt.
+void editorLineIndexUpdate() {
+  struct editorLineIndex *li = &E.lines;
+  int n = E.numrows;
+  if (li->valid >= n) return;
+  if (n > li->cap) {
+    li->cap = n > 2 * li->cap ? n : 2 * li->cap;
+    li->tree = realloc(li->tree, sizeof(long long) * (li->cap + 1));
+  }
+
+  int from = li->valid + 1;
+  for (int i = from; i <= n; i++) li->tree[i] = E.row[i - 1].size + 1;
+  // Valid nodes before 'from' still have to be added into their parents.
+  for (int j = from - 1; j > 0; j -= j & -j)
+    if (j + (j & -j) <= n) li->tree[j + (j & -j)] += li->tree[j];
+  for (int i = from; i <= n; i++)
+    if (i + (i & -i) <= n) li->tree[i + (i & -i)] += li->tree[i];
+  li->valid = n;
 }
 
-// Function to delete a character from a row at a specific position.
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// Function to sum the bytes of the first 'rows' rows of a valid index.
+long long editorLineIndexSum(int rows) {
+  long long sum = 0;
+  for (int i = rows; i > 0; i -= i & -i) sum += E.lines.tree[i];
+  return sum;
 }
-/*** editor operations ***/
 
-// Function to insert a character into the text editor at the current cursor position
-void editorInsertChar(int c) {
-  // Check if the cursor is at the end of the document
-  if (E.cy == E.numrows) {
-    // If so, insert a new empty row
-    editorInsertRow(E.numrows, "", 0);
-  }
-  // Insert the character into the current row at the current cursor position
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  // Move the cursor one position to the right
-  E.cx++;
+// Function to keep an indexed row's length in step after it was edited.
+void editorLineIndexTouch(erow *row) {
+  int i = row->idx + 1;
+  if (i > E.lines.valid) return;
+  long long delta = row->size + 1 -
+    (editorLineIndexSum(i) - editorLineIndexSum(i - 1));
+  if (delta == 0) return;
+  for (; i <= E.lines.valid; i += i & -i) E.lines.tree[i] += delta;
 }
 
-// Function to insert a new line (newline) into the text editor
-void editorInsertNewline() {
-  // Check if the cursor is at the beginning of a line
-  if (E.cx == 0) {
-    // If so, insert a new empty row before the current line
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    // Otherwise, split the current line at the cursor position
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    // Update the current row's size and null-terminate it at the cursor position
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    // Update the display of the current row
-    editorUpdateRow(row);
+// Function to get the byte offset at which a row starts. Inserting or
+// deleting a row invalidates the index from there on; the status bar asks
+// for the cursor row every frame, which is usually just past that point,
+// so a few rows there are added up directly instead of rebuilding the
+// rest of the index after every edit.
+long long editorLineOffset(int row) {
+  if (row > E.numrows) row = E.numrows;
+  if (row - E.lines.valid > KILO_LINE_SCAN) editorLineIndexUpdate();
+  int valid = row < E.lines.valid ? row : E.lines.valid;
+  long long sum = editorLineIndexSum(valid);
+  for (int i = valid; i < row; i++) sum += E.row[i].size + 1;
+  return sum;
+}
+
+// Function to find the row containing a byte offset. The offset of the
+// start of that row is stored in *start.
+int editorLineAtOffset(long long off, long long *start) {
+  editorLineIndexUpdate();
+  int pos = 0;
+  long long sum = 0;
+  int step = 1;
+  while (step * 2 <= E.numrows) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= E.numrows && sum + E.lines.tree[pos + step] <= off) {
+      pos += step;
+      sum += E.lines.tree[pos];
+    }
   }
-  // Move the cursor to the beginning of the next line
-  E.cy++;
-  E.cx = 0;
+  *start = sum;
+  return pos;
 }
 
-// Function to delete a character from the text editor
-void editorDelChar() {
-  // Check if the cursor is at the end of the document or at the very beginning
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+/*** unicode ***/
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    // If the cursor is not at the beginning of the line, delete the character to the left
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+// Rows hold UTF-8. Columns come from decoding it: wide characters take two,
+// combining marks and other zero-width ones none, and bytes that start no
+// valid character one each, drawn like control characters. Rows that are
+// plain ASCII, which is nearly all of them, never decode anything.
+
+// Struct to represent a range of code points with the same display width.
+struct widthRange {
+  int first;                // First code point in the range.
+  int last;                 // Last code point in the range.
+};
+
+// Zero-width code points: combining marks, format characters, variation
+// selectors and the Hangul medial and final jamo.
+static const struct widthRange widthZero[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x061C, 0x061C}, {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DD},
+  {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x070F, 0x070F},
+  {0x0711, 0x0711}, {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3},
+  {0x07FD, 0x07FD}, {0x0816, 0x0819}, {0x081B, 0x0823}, {0x0825, 0x0827},
+  {0x0829, 0x082D}, {0x0859, 0x085B}, {0x0890, 0x0891}, {0x0898, 0x089F},
+  {0x08CA, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+  {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+  {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+  {0x09FE, 0x09FE}, {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A42},
+  {0x0A47, 0x0A48}, {0x0A4B, 0x0A4D}, {0x0A51, 0x0A51}, {0x0A70, 0x0A71},
+  {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC5},
+  {0x0AC7, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3}, {0x0AFA, 0x0AFF},
+  {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44},
+  {0x0B4D, 0x0B4D}, {0x0B55, 0x0B56}, {0x0B62, 0x0B63}, {0x0B82, 0x0B82},
+  {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C00, 0x0C00}, {0x0C04, 0x0C04},
+  {0x0C3C, 0x0C3C}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C48}, {0x0C4A, 0x0C4D},
+  {0x0C55, 0x0C56}, {0x0C62, 0x0C63}, {0x0C81, 0x0C81}, {0x0CBC, 0x0CBC},
+  {0x0CBF, 0x0CBF}, {0x0CC6, 0x0CC6}, {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3},
+  {0x0D00, 0x0D01}, {0x0D3B, 0x0D3C}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D},
+  {0x0D62, 0x0D63}, {0x0D81, 0x0D81}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD4},
+  {0x0DD6, 0x0DD6}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECE}, {0x0F18, 0x0F19},
+  {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+  {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0F97}, {0x0F99, 0x0FBC},
+  {0x0FC6, 0x0FC6}, {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A},
+  {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060}, {0x1071, 0x1074},
+  {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D},
+  {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1733},
+  {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD},
+  {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD}, {0x180B, 0x180F},
+  {0x1885, 0x1886}, {0x18A9, 0x18A9}, {0x1920, 0x1922}, {0x1927, 0x1928},
+  {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B},
+  {0x1A56, 0x1A56}, {0x1A58, 0x1A5E}, {0x1A60, 0x1A60}, {0x1A62, 0x1A62},
+  {0x1A65, 0x1A6C}, {0x1A73, 0x1A7C}, {0x1A7F, 0x1A7F}, {0x1AB0, 0x1ACE},
+  {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C},
+  {0x1B42, 0x1B42}, {0x1B6B, 0x1B73}, {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5},
+  {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD}, {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9},
+  {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1}, {0x1C2C, 0x1C33}, {0x1C36, 0x1C37},
+  {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0}, {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED},
+  {0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+  {0x202A, 0x202E}, {0x2060, 0x2064}, {0x2066, 0x206F}, {0x20D0, 0x20F0},
+  {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF}, {0x302A, 0x302D},
+  {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F},
+  {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806}, {0xA80B, 0xA80B},
+  {0xA825, 0xA826}, {0xA82C, 0xA82C}, {0xA8C4, 0xA8C5}, {0xA8E0, 0xA8F1},
+  {0xA8FF, 0xA8FF}, {0xA926, 0xA92D}, {0xA947, 0xA951}, {0xA980, 0xA982},
+  {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD}, {0xA9E5, 0xA9E5},
+  {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36}, {0xAA43, 0xAA43},
+  {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0}, {0xAAB2, 0xAAB4},
+  {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1}, {0xAAEC, 0xAAED},
+  {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8}, {0xABED, 0xABED},
+  {0xD7B0, 0xD7FF}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+  {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x101FD, 0x101FD}, {0x102E0, 0x102E0},
+  {0x10376, 0x1037A}, {0x10A01, 0x10A03}, {0x10A05, 0x10A06},
+  {0x10A0C, 0x10A0F}, {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F},
+  {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27}, {0x10EAB, 0x10EAC},
+  {0x10F46, 0x10F50}, {0x11001, 0x11001}, {0x11038, 0x11046},
+  {0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA},
+  {0x110BD, 0x110BD}, {0x11100, 0x11102}, {0x11127, 0x1112B},
+  {0x1112D, 0x11134}, {0x11173, 0x11173}, {0x11180, 0x11181},
+  {0x111B6, 0x111BE}, {0x1D167, 0x1D169}, {0x1D173, 0x1D182},
+  {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244},
+  {0x1E000, 0x1E02A}, {0x1E130, 0x1E136}, {0x1E8D0, 0x1E8D6},
+  {0x1E944, 0x1E94A}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F},
+  {0xE0100, 0xE01EF}
+};
+
+// East Asian wide and fullwidth code points, including emoji.
+static const struct widthRange widthWide[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x3247}, {0x3250, 0x4DBF}, {0x4E00, 0xA4CF}, {0xA960, 0xA97F},
+  {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+  {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x16FF0, 0x16FF1},
+  {0x17000, 0x187F7}, {0x18800, 0x18CD5}, {0x18D00, 0x18D08},
+  {0x1B000, 0x1B122}, {0x1B150, 0x1B152}, {0x1B164, 0x1B167},
+  {0x1B170, 0x1B2FB}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+  {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202},
+  {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251},
+  {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335},
+  {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+  {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+  {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+  {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567},
+  {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+  {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+  {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6DC, 0x1F6DF},
+  {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+  {0x1F7F0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+  {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FA7C}, {0x1FA80, 0x1FA88},
+  {0x1FA90, 0x1FABD}, {0x1FABF, 0x1FAC5}, {0x1FACE, 0x1FADB},
+  {0x1FAE0, 0x1FAE8}, {0x1FAF0, 0x1FAF8}, {0x20000, 0x2FFFD},
+  {0x30000, 0x3FFFD}
+};
+
+// Struct to represent the two-level display width table: a block number
+// for every 256 code points, and the distinct blocks, four 2-bit widths to
+// a byte. Most blocks are all one width and share a single copy.
+struct widthTable {
+  unsigned char index[0x110000 >> 8]; // Block of every 256 code points.
+  unsigned char (*blocks)[64];        // Distinct blocks of widths.
+  int nblocks;                        // Number of distinct blocks.
+};
+
+struct widthTable W;
+
+// Function to set the width of the code points of ranges r that fall in
+// the block starting at base.
+void editorWidthFill(unsigned char *block, int base, const struct widthRange *r, int n, int width) {
+  for (int i = 0; i < n && r[i].first < base + 256; i++) {
+    if (r[i].last < base) continue;
+    int lo = r[i].first > base ? r[i].first - base : 0;
+    int hi = r[i].last < base + 255 ? r[i].last - base : 255;
+    for (int k = lo; k <= hi; k++)
+      block[k >> 2] = (block[k >> 2] & ~(3 << (k & 3) * 2)) | width << (k & 3) * 2;
+  }
+}
+
+// Function to build the display width table, the first time a character
+// outside Latin-1 is measured. nblocks is set last, so a table that reads
+// as built is complete.
+void editorWidthInit() {
+  int nblocks = 0;
+  W.blocks = malloc(256 * sizeof(*W.blocks));
+  if (W.blocks == NULL) die("malloc");
+  for (int b = 0; b < (0x110000 >> 8); b++) {
+    unsigned char block[64];
+    memset(block, 0x55, sizeof(block));
+    editorWidthFill(block, b << 8, widthWide, sizeof(widthWide) / sizeof(widthWide[0]), 2);
+    editorWidthFill(block, b << 8, widthZero, sizeof(widthZero) / sizeof(widthZero[0]), 0);
+
+    int k = 0;
+    while (k < nblocks && memcmp(W.blocks[k], block, sizeof(block)) != 0) k++;
+    // The ranges make far fewer than 256 distinct blocks.
+    if (k == nblocks && k < 256) memcpy(W.blocks[nblocks++], block, sizeof(block));
+    W.index[b] = k < 256 ? k : 0;
+  }
+  W.nblocks = nblocks;
+}
+
+// Function to get the number of columns a code point takes on screen.
+// Anything that is not a character (-1) takes one.
+int editorCodeWidth(int cp) {
+  if (cp < 0x300) return 1;
+  if (W.nblocks == 0) editorWidthInit();
+  return (W.blocks[W.index[cp >> 8]][(cp & 255) >> 2] >> (cp & 3) * 2) & 3;
+}
+
+// Function to decode the UTF-8 character at s, which has len bytes left,
+// into *cp. Returns its length. A byte that starts no valid character is
+// one byte long and decodes to -1, as do C1 controls, which terminals
+// would act on.
+int editorUtf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c;
+  *cp = -1;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+    n = 2;
+    c = u[0] & 0x1F;
+  } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+    n = 3;
+    c = u[0] & 0x0F;
+  } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+    n = 4;
+    c = u[0] & 0x07;
+  } else {
+    return 1;
+  }
+  if (len < n) return 1;
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xC0) != 0x80) return 1;
+    c = c << 6 | (u[i] & 0x3F);
+  }
+  // Reject overlong forms, surrogates and code points past Unicode.
+  if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+      (c >= 0xD800 && c <= 0xDFFF) || c < 0xA0)
+    return 1;
+  *cp = c;
+  return n;
+}
+
+// Function to get the columns byte j of len bytes of text adds: the whole
+// width of a character on its first byte, and nothing on the rest.
+int editorByteWidth(const char *s, int len, int j) {
+  unsigned char c = s[j];
+  int cp;
+  if (c < 0x80) return 1;
+  if ((c & 0xC0) != 0x80) {
+    editorUtf8Decode(&s[j], len - j, &cp);
+    return editorCodeWidth(cp);
+  }
+  // A continuation byte is free only inside a character that decodes.
+  for (int k = j - 1; k >= 0 && k >= j - 3; k--) {
+    if (((unsigned char)s[k] & 0xC0) != 0x80)
+      return k + editorUtf8Decode(&s[k], len - k, &cp) > j ? 0 : 1;
+  }
+  return 1;
+}
+
+// Function to check whether len bytes of text are all ASCII. The high bits
+// are tested 32 bytes at a time, which compilers turn into vector code.
+int editorIsAscii(const char *s, int len) {
+  const unsigned long long high = 0x8080808080808080ULL;
+  int j = 0;
+  for (; j + 32 <= len; j += 32) {
+    unsigned long long w[4];
+    memcpy(w, s + j, sizeof(w));
+    if ((w[0] | w[1] | w[2] | w[3]) & high) return 0;
+  }
+  for (; j < len; j++) {
+    if (s[j] & 0x80) return 0;
+  }
+  return 1;
+}
+
+/*** row operations ***/
+
+// Function to get the column that character j of a row, starting at
+// column rx, ends at.
+int editorRowAdvance(erow *row, int j, int rx) {
+  unsigned char c = row->chars[j];
+  if (c == '\t') return rx + KILO_TAB_STOP - rx % KILO_TAB_STOP;
+  return rx + (c < 0x80 ? 1 : editorByteWidth(row->chars, row->size, j));
+}
+
+// Function to get the table of rx values at every KILO_RX_STEP-th cx of a
+// row, or NULL if the row is short enough to be walked directly.
+int *editorRowRxMap(erow *row) {
+  if (row->size < KILO_RX_STEP) return NULL;
+  if (row->rxmap) return row->rxmap;
+
+  int *map = editorRowAlloc(sizeof(int) * (row->size / KILO_RX_STEP + 1));
+  int rx = 0;
+  for (int j = 0; j <= row->size; j++) {
+    if (j % KILO_RX_STEP == 0) map[j / KILO_RX_STEP] = rx;
+    if (j < row->size) rx = editorRowAdvance(row, j, rx);
+  }
+  row->rxmap = map;
+  return map;
+}
+
+// Function to convert the character index (cx) to the visual index (rx) for rendering.
+int editorRowCxToRx(erow *row, int cx) {
+  // Without tabs or multibyte characters every byte is one column wide.
+  if (row->tabs == 0 && !row->utf8) return cx;
+
+  int rx = 0;
+  int j = 0;
+  int *map = editorRowRxMap(row);
+  if (map && cx <= row->size) {
+    j = cx - cx % KILO_RX_STEP;
+    rx = map[j / KILO_RX_STEP];
+  }
+  for (; j < cx; j++) rx = editorRowAdvance(row, j, rx);
+  return rx;
+}
+
+// Function to convert the visual index (rx) to the character index (cx).
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->tabs == 0 && !row->utf8) return rx < row->size ? rx : row->size;
+
+  int cur_rx = 0;
+  int cx = 0;
+  int *map = editorRowRxMap(row);
+  if (map) {
+    // Start from the last checkpoint that is not past rx.
+    int lo = 0, hi = row->size / KILO_RX_STEP;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (map[mid] <= rx) lo = mid;
+      else hi = mid - 1;
+    }
+    cx = lo * KILO_RX_STEP;
+    cur_rx = map[lo];
+  }
+  for (; cx < row->size; cx++) {
+    cur_rx = editorRowAdvance(row, cx, cur_rx);
+    if (cur_rx > rx) return cx;
+  }
+  return cx;
+}
+
+// Function to find where the character after the one at byte at of a
+// row starts.
+int editorRowNextChar(erow *row, int at) {
+  int cp;
+  if (!row->utf8) return at + 1;
+  return at + editorUtf8Decode(&row->chars[at], row->size - at, &cp);
+}
+
+// Function to find where the character holding byte at of a row starts.
+int editorRowCharStart(erow *row, int at) {
+  int cp;
+  if (!row->utf8 || at >= row->size) return at;
+  for (int k = at; k >= 0 && k >= at - 3; k--) {
+    if (((unsigned char)row->chars[k] & 0xC0) != 0x80)
+      return k + editorUtf8Decode(&row->chars[k], row->size - k, &cp) > at ? k : at;
+  }
+  return at;
+}
+
+// Function to find where the character before byte at of a row starts.
+int editorRowPrevChar(erow *row, int at) {
+  return editorRowCharStart(row, at - 1);
+}
+
+// Function to get the number of columns a whole row takes.
+int editorRowWidth(erow *row) {
+  if (!row->utf8) return row->rsize;
+  return editorRowCxToRx(row, row->size);
+}
+
+// Function to find the render column that render byte at of a row is in.
+int editorRowRenderCol(erow *row, int at) {
+  if (!row->utf8) return at;
+  int x = 0;
+  for (int j = 0; j < at; j++) x += editorByteWidth(row->render, row->rsize, j);
+  return x;
+}
+
+// Function to advance from render byte j of a row, at column *x, to the
+// first character that starts at or after column col and is not zero
+// width; those belong with the character before them. *x receives the
+// column that character starts at.
+int editorRowSkip(erow *row, int j, int *x, int col) {
+  if (!row->utf8) {
+    j = col < row->rsize ? col : row->rsize;
+    *x = j;
+    return j;
+  }
+  while (j < row->rsize) {
+    int cp, n = editorUtf8Decode(&row->render[j], row->rsize - j, &cp);
+    int w = editorCodeWidth(cp);
+    if (*x >= col && w > 0) break;
+    *x += w;
+    j += n;
+  }
+  return j;
+}
+
+// Function to find the columns where the visual lines of len bytes of
+// render text wrapped at width start, after the first. Lines end after the
+// last space that fits, or before the first character that doesn't if
+// there is none. Starts go to out unless it is NULL; the number of them is
+// returned.
+int editorWrapBreaks(const char *render, int len, int width, int *out) {
+  int n = 0, start = 0, col = 0, space = 0;
+  for (int j = 0; j < len;) {
+    int cp = (unsigned char)render[j], step = 1, w = 1;
+    if (cp >= 0x80) {
+      step = editorUtf8Decode(&render[j], len - j, &cp);
+      w = editorCodeWidth(cp);
+    }
+    if (col + w > start + width && col > start) {
+      start = space > start ? space : col;
+      if (out) out[n] = start;
+      n++;
+      continue;
+    }
+    col += w;
+    j += step;
+    if (cp == ' ') space = col;
+  }
+  return n;
+}
+
+// Function to get the starts of a row's visual lines after the first when
+// wrapped at width columns; *n receives how many there are. Rows that fit
+// keep no table. A table lasts until the row changes, and one is kept for
+// each of the last KILO_WRAP_TABLES widths, so panes of different widths
+// don't rebuild each other's every frame. The block holds the number of
+// tables, then each as [width, count, starts...], oldest first.
+int *editorRowWrap(erow *row, int width, int *n) {
+  char *render = editorRowRender(row);
+  if (width < 1) width = 1;
+  if (row->rsize <= width) {
+    *n = 0;
+    return NULL;
+  }
+  int tables = row->wrap ? row->wrap[0] : 0;
+  int *t = row->wrap ? row->wrap + 1 : NULL;
+  for (int i = 0; i < tables; i++) {
+    if (t[0] == width) {
+      *n = t[1];
+      return t + 2;
+    }
+    t += t[1] + 2;
+  }
+
+  // Not laid out at this width yet: drop the oldest table if all are
+  // taken and add one at the end.
+  int used = row->wrap ? t - row->wrap : 1;
+  if (tables == KILO_WRAP_TABLES) {
+    int drop = row->wrap[2] + 2;
+    memmove(row->wrap + 1, row->wrap + 1 + drop, sizeof(int) * (used - 1 - drop));
+    used -= drop;
+    tables--;
+  }
+  int count = editorWrapBreaks(render, row->rsize, width, NULL);
+  row->wrap = editorRowRealloc(row->wrap, sizeof(int) * (used + count + 2));
+  row->wrap[0] = tables + 1;
+  t = row->wrap + used;
+  t[0] = width;
+  t[1] = count;
+  editorWrapBreaks(render, row->rsize, width, t + 2);
+  *n = count;
+  return t + 2;
+}
+
+// Function to count the visual lines of a row wrapped at width columns.
+int editorRowLines(erow *row, int width) {
+  int n;
+  editorRowWrap(row, width, &n);
+  return n + 1;
+}
+
+// Function to get the render columns [*start, *end) that visual line k of
+// a row wrapped at width columns spans.
+void editorRowLineSpan(erow *row, int width, int k, int *start, int *end) {
+  int n;
+  int *brk = editorRowWrap(row, width, &n);
+  *start = k ? brk[k - 1] : 0;
+  *end = k < n ? brk[k] : editorRowWidth(row);
+}
+
+// Function to find the visual line of a row holding render column rx.
+int editorRowLineOf(erow *row, int width, int rx) {
+  int n;
+  int *brk = editorRowWrap(row, width, &n);
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (brk[mid - 1] <= rx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Function to count the tabs in a piece of text.
+int editorCountTabs(const char *s, int len) {
+  int tabs = 0;
+  const char *end = s + len;
+  while (s < end && (s = memchr(s, '\t', end - s)) != NULL) {
+    tabs++;
+    s++;
+  }
+  return tabs;
+}
+
+// Function to expand the tabs of chars into dst, which must have room for
+// size + tabs * (KILO_TAB_STOP - 1) + 1 bytes. Returns the rendered length.
+int editorRenderTabs(char *dst, const char *chars, int size) {
+  int idx = 0, col = 0;
+  for (int j = 0; j < size; j++) {
+    if (chars[j] == '\t') {
+      // Tab stops are counted in columns, not bytes.
+      dst[idx++] = ' ';
+      while (++col % KILO_TAB_STOP != 0) dst[idx++] = ' ';
+    } else {
+      dst[idx++] = chars[j];
+      col += (unsigned char)chars[j] < 0x80 ? 1 : editorByteWidth(chars, size, j);
+    }
+  }
+  dst[idx] = '\0';
+  return idx;
+}
+
+// Function to lay out the render text of a row after its chars, growing
+// the row's block from pool if needed.
+void editorRowLayout(struct rowPool *pool, erow *row) {
+  // chars, render and hl share one block laid out in that order; hl is
+  // placed by editorRowHlStore once it is known how large it is. Rows
+  // without tabs render as their own chars and skip the copy; the first
+  // tab typed into such a row breaks the alias.
+  int maxr = row->size + row->tabs * (KILO_TAB_STOP - 1);
+  size_t need = row->size + 1 + (row->tabs ? maxr + 1 : 0);
+  if (editorRowCapacity(row->chars) < need)
+    row->chars = editorPoolRealloc(pool, row->chars, need);
+  if (row->tabs == 0) {
+    row->render = row->chars;
+    row->rsize = row->size;
+  } else {
+    row->render = &row->chars[row->size + 1];
+    row->rsize = editorRenderTabs(row->render, row->chars, row->size);
+  }
+}
+
+// Function to update the rendered version of a row.
+void editorUpdateRow(erow *row) {
+  // The cursor mapping and wrapping tables are rebuilt on demand.
+  editorRowFree(row->rxmap);
+  row->rxmap = NULL;
+  editorRowFree(row->wrap);
+  row->wrap = NULL;
+
+  editorRowLayout(&E.pool, row);
+
+  // Update syntax highlighting for the row.
+  PROF_BEGIN(PROF_HIGHLIGHT);
+  editorUpdateSyntax(row);
+  PROF_END(PROF_HIGHLIGHT);
+
+  // Make sure searches still look at the row if its trigrams changed.
+  editorTriIndexTouch(row->idx);
+  editorLineIndexTouch(row);
+}
+
+// Function to get a row's render text, laying it out again if the buffer
+// was compacted while in the background.
+char *editorRowRender(erow *row) {
+  if (row->render == NULL) editorRowLayout(&E.pool, row);
+  return row->render;
+}
+
+// Function to make sure a row has render text and highlighting. Only the
+// row itself is highlighted; its comment state is still known.
+void editorRowEnsure(erow *row) {
+  if (row->hl) return;
+  editorRowRender(row);
+  unsigned char *hl = editorHlScratch(row->rsize);
+  memset(hl, HL_NORMAL, row->rsize);
+  if (E.syntax) {
+    int in_comment = row->idx > 0 && E.row[row->idx - 1].hl_open_comment;
+    editorHighlight(row->render, row->rsize, in_comment, hl);
+  }
+  editorRowHlStore(&E.pool, row, hl);
+  PROF_COUNT(rows_hl, 1);
+}
+
+// Function to fill in a new row holding a copy of s, not yet rendered.
+void editorRowSet(erow *row, int at, char *s, size_t len) {
+  row->idx = at;
+
+  row->size = len;
+  // Room for chars and a few highlight runs, which is all most rows need.
+  row->chars = editorRowAlloc(len + 1 + 32);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->tabs = editorCountTabs(s, len);
+  row->utf8 = !editorIsAscii(s, len);
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_runs = 0;
+  row->rxmap = NULL;
+  row->wrap = NULL;
+  row->hl_open_comment = 0;
+}
+
+// Function to insert a new row at a specific position.
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  editorUndoRecordRow(UNDO_ROW_INS, at, s, len);
+  editorTriIndexInsert(at, 1);
+  editorLineIndexTruncate(at);
+
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+
+  editorRowSet(&E.row[at], at, s, len);
+  editorUpdateRow(&E.row[at]);
+
+  E.numrows++;
+  E.dirty++;
+}
+
+// Function to free memory associated with a row.
+void editorFreeRow(erow *row) {
+  editorRowFree(row->chars);
+  editorRowFree(row->rxmap);
+  editorRowFree(row->wrap);
+}
+
+// Function to drop every row at once, handing their buffers back in bulk.
+void editorFreeAllRows() {
+  editorRowPoolRelease(&E.pool);
+  free(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  editorTriIndexFree();
+  editorLineIndexFree();
+}
+
+// Function to delete a row at a specific position.
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorUndoRecordRow(UNDO_ROW_DEL, at, E.row[at].chars, E.row[at].size);
+  editorTriIndexDelete(at, 1);
+  editorLineIndexTruncate(at);
+  int open = E.row[at].hl_open_comment;
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+  E.numrows--;
+  E.dirty++;
+
+  // The next row was highlighted as following the deleted one.
+  if (at < E.numrows && open != (at > 0 && E.row[at - 1].hl_open_comment))
+    editorUpdateSyntax(&E.row[at]);
+}
+
+// Function to replace dellen characters at 'at' with len characters from s.
+// All in-row edits go through here so they are recorded in the undo log.
+void editorRowSplice(erow *row, int at, int dellen, char *s, int len) {
+  editorUndoRecord(row->idx, at, &row->chars[at], dellen, s, len);
+
+  int newsize = row->size - dellen + len;
+  row->tabs += editorCountTabs(s, len) - editorCountTabs(&row->chars[at], dellen);
+  // Deleting never clears the flag; rows that lost their last non-ASCII
+  // byte just take the slower path until they are set again.
+  if (!editorIsAscii(s, len)) row->utf8 = 1;
+  // Growing may overwrite render and hl; editorUpdateRow rebuilds them.
+  if (editorRowCapacity(row->chars) < (size_t)newsize + 1)
+    row->chars = editorRowRealloc(row->chars, 2 * newsize + 1);
+  memmove(&row->chars[at + len], &row->chars[at + dellen],
+          row->size - at - dellen + 1);
+  if (len) memcpy(&row->chars[at], s, len);
+  row->size = newsize;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+// Function to insert a character into a row at a specific position.
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  char ch = c;
+  editorRowSplice(row, at, 0, &ch, 1);
+}
+
+// Function to append a string to the end of a row.
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowSplice(row, row->size, 0, s, len);
+}
+
+// Function to delete a character from a row at a specific position.
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowSplice(row, at, 1, NULL, 0);
+}
+
+/*** undo ***/
+
+// Function to read the header and text of the record ending at offset end.
+size_t undoLogRecord(struct undoLog *log, size_t end, undoRec *h, char **text) {
+  unsigned int size;
+  memcpy(&size, &log->buf[end - sizeof(size)], sizeof(size));
+  size_t off = end - size;
+  memcpy(h, &log->buf[off], sizeof(*h));
+  if (text) *text = &log->buf[off + sizeof(*h)];
+  return off;
+}
+
+// Function to make room for extra bytes at the end of a log.
+void undoLogReserve(struct undoLog *log, size_t extra) {
+  if (log->len + extra <= log->cap) return;
+  while (log->len + extra > log->cap) log->cap = log->cap ? log->cap * 2 : 4096;
+  log->buf = realloc(log->buf, log->cap);
+}
+
+// Function to append one complete record to a log.
+void undoLogAppend(struct undoLog *log, undoRec *h, char *old, char *new) {
+  unsigned int size = sizeof(*h) + h->oldlen + h->newlen + sizeof(size);
+  undoLogReserve(log, size);
+  char *p = &log->buf[log->len];
+  memcpy(p, h, sizeof(*h));
+  p += sizeof(*h);
+  if (h->oldlen) memcpy(p, old, h->oldlen);
+  p += h->oldlen;
+  if (h->newlen) memcpy(p, new, h->newlen);
+  p += h->newlen;
+  memcpy(p, &size, sizeof(size));
+  log->len += size;
+}
+
+// Function to grow the newest record by one character, keeping it in place.
+void undoLogExtend(struct undoLog *log, undoRec *h, char c, int prepend) {
+  size_t off = undoLogRecord(log, log->len, h, NULL);
+  undoLogReserve(log, 1);
+  char *text = &log->buf[off + sizeof(*h)];
+  int tlen = h->oldlen + h->newlen;
+
+  if (prepend) {
+    memmove(&text[1], text, tlen);
+    text[0] = c;
+  } else {
+    text[tlen] = c;
+  }
+  if (h->type == UNDO_INS) h->newlen++;
+  else h->oldlen++;
+  if (prepend) h->col--;
+
+  unsigned int size = sizeof(*h) + h->oldlen + h->newlen + sizeof(size);
+  memcpy(&log->buf[off], h, sizeof(*h));
+  memcpy(&text[tlen + 1], &size, sizeof(size));
+  log->len = off + size;
+}
+
+// Function to drop the oldest groups until the undo log fits its limit.
+void editorUndoTrim() {
+  struct undoLog *log = &E.undo.undo;
+  while (log->len - log->start > E.undo.limit) {
+    undoRec h;
+    memcpy(&h, &log->buf[log->start], sizeof(h));
+
+    // A group that alone exceeds the limit can't be undone consistently.
+    if (E.undo.depth && h.group == E.undo.group) {
+      E.undo.dropped = h.group;
+      log->start = log->len = 0;
+      return;
+    }
+
+    unsigned int group = h.group;
+    while (log->start < log->len) {
+      memcpy(&h, &log->buf[log->start], sizeof(h));
+      if (h.group != group) break;
+      log->start += sizeof(h) + h.oldlen + h.newlen + sizeof(unsigned int);
+    }
+  }
+
+  // Reclaim the dropped prefix once it dominates the buffer.
+  if (log->start && log->start >= log->len / 2) {
+    memmove(log->buf, &log->buf[log->start], log->len - log->start);
+    log->len -= log->start;
+    log->start = 0;
+  }
+}
+
+// Function to add an edit to the undo log, merging consecutive keystrokes.
+// Every buffer mutation passes through here, so it also feeds the journal.
+void editorUndoPush(int type, int row, int col, char *old, int oldlen,
+                    char *new, int newlen) {
+  undoRec h;
+  memset(&h, 0, sizeof(h));
+  h.type = type;
+  h.row = row;
+  h.col = col;
+  h.oldlen = oldlen;
+  h.newlen = newlen;
+  editorJournalRecord(&h, new);
+
+  if (E.undo.suspended) return;
+  E.undo.redo.start = E.undo.redo.len = 0;
+  if (E.undo.depth && E.undo.group == E.undo.dropped) return;
+
+  struct undoLog *log = &E.undo.undo;
+  int keystroke = (E.undo.depth == 0 && oldlen + newlen == 1);
+  if (keystroke && !E.undo.sealed && log->len > log->start) {
+    undoRec last;
+    undoLogRecord(log, log->len, &last, NULL);
+    if ((last.flags & UNDO_COALESCE) && last.type == type && last.row == row) {
+      if (type == UNDO_INS && last.col + last.newlen == col) {
+        undoLogExtend(log, &last, new[0], 0);
+        return;
+      } else if (type == UNDO_DEL && last.col == col) {
+        undoLogExtend(log, &last, old[0], 0);
+        return;
+      } else if (type == UNDO_DEL && last.col == col + 1) {
+        undoLogExtend(log, &last, old[0], 1);
+        return;
+      }
+    }
+  }
+
+  h.flags = keystroke ? UNDO_COALESCE : 0;
+  h.group = E.undo.depth ? E.undo.group : ++E.undo.group;
+  undoLogAppend(log, &h, old, new);
+  E.undo.sealed = 0;
+  editorUndoTrim();
+}
+
+// Function to record an in-row edit; the kind follows from the lengths.
+void editorUndoRecord(int row, int col, char *old, int oldlen, char *new, int newlen) {
+  if (oldlen == 0 && newlen == 0) return;
+  int type = oldlen == 0 ? UNDO_INS : newlen == 0 ? UNDO_DEL : UNDO_REPL;
+  editorUndoPush(type, row, col, old, oldlen, new, newlen);
+}
+
+// Function to record a whole row being inserted or deleted.
+void editorUndoRecordRow(int type, int at, char *s, int len) {
+  if (type == UNDO_ROW_INS) editorUndoPush(type, at, 0, NULL, 0, s, len);
+  else editorUndoPush(type, at, 0, s, len, NULL, 0);
+}
+
+// Function to start a group of edits that is undone as one step.
+void editorUndoBeginGroup() {
+  if (E.undo.depth++ == 0) E.undo.group++;
+}
+
+// Function to close the innermost group of edits.
+void editorUndoEndGroup() {
+  if (--E.undo.depth == 0) E.undo.sealed = 1;
+  if (E.undo.depth == 0 && editorUndoLost())
+    editorSetStatusMessage("Too large to undo; the undo history was cleared");
+}
+
+// Function to tell whether the newest group outgrew the undo limit and was
+// dropped, along with all the history before it.
+int editorUndoLost() {
+  return E.undo.group == E.undo.dropped;
+}
+
+// Function to forget all history, e.g. after loading a new file.
+void editorUndoReset() {
+  E.undo.undo.start = E.undo.undo.len = 0;
+  E.undo.redo.start = E.undo.redo.len = 0;
+  E.undo.sealed = 1;
+}
+
+// Function to apply a record backwards (undo) or forwards (redo).
+void editorUndoApply(undoRec *h, char *text, int reverse) {
+  char *old = text;
+  char *new = text + h->oldlen;
+  E.cy = h->row;
+  E.cx = h->col;
+
+  switch (h->type) {
+    case UNDO_INS:
+    case UNDO_DEL:
+    case UNDO_REPL:
+      if (reverse) {
+        editorRowSplice(&E.row[h->row], h->col, h->newlen, old, h->oldlen);
+        E.cx += h->oldlen;
+      } else {
+        editorRowSplice(&E.row[h->row], h->col, h->oldlen, new, h->newlen);
+        E.cx += h->newlen;
+      }
+      break;
+    case UNDO_ROW_INS:
+      if (reverse) editorDelRow(h->row);
+      else editorInsertRow(h->row, new, h->newlen);
+      break;
+    case UNDO_ROW_DEL:
+      if (reverse) editorInsertRow(h->row, old, h->oldlen);
+      else editorDelRow(h->row);
+      break;
+  }
+}
+
+// Function to move the newest group from one log to the other, applying it.
+void editorUndoStep(int redo) {
+  struct undoLog *from = redo ? &E.undo.redo : &E.undo.undo;
+  struct undoLog *to = redo ? &E.undo.undo : &E.undo.redo;
+  if (from->len == from->start) {
+    editorSetStatusMessage(redo ? "Nothing to redo" : "Nothing to undo");
+    return;
+  }
+
+  undoRec h;
+  char *text;
+  undoLogRecord(from, from->len, &h, NULL);
+  unsigned int group = h.group;
+
+  E.undo.suspended++;
+  while (from->len > from->start) {
+    size_t off = undoLogRecord(from, from->len, &h, &text);
+    if (h.group != group) break;
+    editorUndoApply(&h, text, !redo);
+    undoLogAppend(to, &h, text, text + h.oldlen);
+    from->len = off;
+  }
+  E.undo.suspended--;
+  E.undo.sealed = 1;
+
+  // Keep the cursor inside the text after rows came or went.
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy == E.numrows) E.cx = 0;
+  else if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+}
+
+// Function to undo the most recent group of edits.
+void editorUndo() {
+  editorUndoStep(0);
+}
+
+// Function to redo the most recently undone group of edits.
+void editorRedo() {
+  editorUndoStep(1);
+}
+
+/*** journal ***/
+
+// Function to read the monotonic clock in milliseconds.
+long long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to read the monotonic clock in nanoseconds.
+long long editorNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Function to build the path of a hidden file ".<name><suffix>" next to a file.
+char *editorSiblingPath(char *filename, char *suffix) {
+  char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + strlen(suffix) + 2);
+  sprintf(path, "%.*s.%s%s", dirlen, filename, filename + dirlen, suffix);
+  return path;
+}
+
+// Function to build the journal path ".<name>.kjournal" next to a file.
+char *editorJournalPath(char *filename) {
+  return editorSiblingPath(filename, ".kjournal");
+}
+
+// Function to describe the file on disk as a journal header.
+void editorJournalHeader(struct journalHdr *jh, char *filename) {
+  struct stat st;
+  memset(jh, 0, sizeof(*jh));
+  memcpy(jh->magic, "KILOJNL1", 8);
+  if (stat(filename, &st) == 0) {
+    jh->size = st.st_size;
+    jh->mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+}
+
+// Function to write out pending records; with sync they are also fsync'd.
+// A write that fails part way is cut off again, so the records are kept
+// and written whole next time instead of twice.
+void editorJournalFlush(int sync) {
+  if (E.journal.fd == -1) return;
+  if (E.journal.len) {
+    off_t at = lseek(E.journal.fd, 0, SEEK_CUR);
+    if (editorWriteAll(E.journal.fd, E.journal.buf, E.journal.len) == 0) {
+      E.journal.len = 0;
+      E.journal.unsynced = 1;
+    } else if (at != -1 && ftruncate(E.journal.fd, at) == 0) {
+      lseek(E.journal.fd, at, SEEK_SET);
+    }
+  }
+  if (sync) {
+    if (fdatasync(E.journal.fd) == 0) E.journal.unsynced = 0;
+    E.journal.last_flush = editorNowMs();
+  }
+}
+
+// Function to flush the journal from the idle loop once the interval
+// passed, including records a full batch already wrote out unsynced.
+void editorJournalTick() {
+  if (E.journal.fd == -1 || (E.journal.len == 0 && !E.journal.unsynced)) return;
+  if (editorNowMs() - E.journal.last_flush >= KILO_JOURNAL_FLUSH_MS)
+    editorJournalFlush(1);
+}
+
+// Function to queue a mutation for the journal. Only the new text is kept,
+// which is all a forward replay needs; writing happens in batches later.
+void editorJournalRecord(undoRec *h, char *new) {
+  if (E.journal.fd == -1) return;
+
+  size_t need = sizeof(*h) + h->newlen;
+  if (E.journal.len + need > E.journal.cap) {
+    while (E.journal.len + need > E.journal.cap)
+      E.journal.cap = E.journal.cap ? E.journal.cap * 2 : 4096;
+    E.journal.buf = realloc(E.journal.buf, E.journal.cap);
+  }
+  memcpy(&E.journal.buf[E.journal.len], h, sizeof(*h));
+  if (h->newlen) memcpy(&E.journal.buf[E.journal.len + sizeof(*h)], new, h->newlen);
+  E.journal.len += need;
+
+  if (E.journal.len >= KILO_JOURNAL_BATCH) editorJournalFlush(0);
+}
+
+// Function to open the journal for the current file. With keep > 0 the
+// first keep bytes of a recovered journal stay; otherwise it starts afresh
+// from the file contents on disk. Scripted runs keep no journal: the one
+// on disk may hold a crashed session's edits, which they never recover.
+void editorJournalStart(off_t keep) {
+  if (E.filename == NULL || E.batch) return;
+  if (E.journal.path == NULL) E.journal.path = editorJournalPath(E.filename);
+  if (E.journal.fd == -1)
+    E.journal.fd = open(E.journal.path, O_WRONLY | O_CREAT, 0600);
+  if (E.journal.fd == -1) return;
+  E.journal.len = 0;
+  E.journal.unsynced = 0;
+
+  if (keep > 0) {
+    // Cut off a torn record at the end so new records follow valid ones.
+    if (ftruncate(E.journal.fd, keep) == -1) {
+      close(E.journal.fd);
+      E.journal.fd = -1;
+      return;
+    }
+    lseek(E.journal.fd, 0, SEEK_END);
+    E.journal.last_flush = editorNowMs();
+    return;
+  }
+
+  struct journalHdr jh;
+  editorJournalHeader(&jh, E.filename);
+  if (ftruncate(E.journal.fd, 0) == -1 ||
+      pwrite(E.journal.fd, &jh, sizeof(jh), 0) != sizeof(jh)) {
+    close(E.journal.fd);
+    E.journal.fd = -1;
+    return;
+  }
+  lseek(E.journal.fd, 0, SEEK_END);
+  fdatasync(E.journal.fd);
+  E.journal.last_flush = editorNowMs();
+}
+
+// Function to point the journal header at the file as it is now. Follow
+// mode reads appended lines in without recording them, so the records
+// still apply to the grown file, but the old header would no longer match.
+void editorJournalRebase() {
+  if (E.journal.fd == -1) return;
+  struct journalHdr jh;
+  editorJournalHeader(&jh, E.filename);
+  if (pwrite(E.journal.fd, &jh, sizeof(jh), 0) == sizeof(jh)) E.journal.unsynced = 1;
+}
+
+// Function to close the journal; it is deleted unless changes are unsaved.
+void editorJournalClose(int keep) {
+  if (E.batch) return;
+  if (E.journal.fd != -1) {
+    editorJournalFlush(1);
+    close(E.journal.fd);
+    E.journal.fd = -1;
+  }
+  if (!keep && E.journal.path) unlink(E.journal.path);
+  free(E.journal.path);
+  E.journal.path = NULL;
+}
+
+// Function to replay a journal left behind for the file just loaded.
+// Returns the number of edits applied, or -1 if there was nothing to recover;
+// *valid receives the journal length up to the last applied record.
+int editorJournalReplay(off_t *valid) {
+  char *path = editorJournalPath(E.filename);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) return -1;
+
+  // The journal only applies to the exact file contents it was started on.
+  struct journalHdr jh, cur;
+  editorJournalHeader(&cur, E.filename);
+  if (read(fd, &jh, sizeof(jh)) != sizeof(jh) || memcmp(&jh, &cur, sizeof(jh))) {
+    close(fd);
+    return -1;
+  }
+
+  // Ask before touching the buffer; scripted runs never recover.
+  if (E.batch) {
+    close(fd);
+    return -1;
+  }
+  editorSetStatusMessage("Unsaved changes found in journal. Recover them? (y/n)");
+  editorRefreshScreen();
+  if (editorReadKey() != 'y') {
+    close(fd);
+    return -1;
+  }
+  // Records refer to rows anywhere in the file.
+  editorLoadFinish();
+
+  FILE *fp = fdopen(fd, "r");
+  int applied = 0;
+  *valid = sizeof(jh);
+  undoRec h;
+  char *text = NULL;
+  int textcap = 0;
+
+  // Stop at the first record that is incomplete or doesn't fit the buffer.
+  while (fread(&h, sizeof(h), 1, fp) == 1) {
+    if (h.newlen < 0 || h.oldlen < 0) break;
+    if (h.newlen > textcap) {
+      textcap = h.newlen;
+      text = realloc(text, textcap);
+    }
+    if (h.newlen && fread(text, h.newlen, 1, fp) != 1) break;
+
+    if (h.type == UNDO_ROW_INS) {
+      if (h.row < 0 || h.row > E.numrows) break;
+      editorInsertRow(h.row, text, h.newlen);
+    } else if (h.type == UNDO_ROW_DEL) {
+      if (h.row < 0 || h.row >= E.numrows) break;
+      editorDelRow(h.row);
+    } else {
+      if (h.row < 0 || h.row >= E.numrows || h.col < 0 ||
+          h.col + h.oldlen > E.row[h.row].size) break;
+      editorRowSplice(&E.row[h.row], h.col, h.oldlen, text, h.newlen);
+    }
+    applied++;
+    *valid = ftello(fp);
+  }
+  free(text);
+  fclose(fp);
+  return applied;
+}
+
+/*** editor operations ***/
+
+// Function to insert a character into the text editor at the current cursor position
+void editorInsertChar(int c) {
+  // Check if the cursor is at the end of the document
+  if (E.cy == E.numrows) {
+    // If so, insert a new empty row
+    editorInsertRow(E.numrows, "", 0);
+  }
+  // Insert the character into the current row at the current cursor position
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  // Move the cursor one position to the right
+  E.cx++;
+}
+
+// Function to insert a new line (newline) into the text editor
+void editorInsertNewline() {
+  editorUndoBeginGroup();
+  // Check if the cursor is at the beginning of a line
+  if (E.cx == 0) {
+    // If so, insert a new empty row before the current line
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    // Otherwise, split the current line at the cursor position
+    erow *row = &E.row[E.cy];
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    // Cut the current row at the cursor position
+    row = &E.row[E.cy];
+    editorRowSplice(row, E.cx, row->size - E.cx, NULL, 0);
+  }
+  editorUndoEndGroup();
+  // Move the cursor to the beginning of the next line
+  E.cy++;
+  E.cx = 0;
+}
+
+// Function to delete a character from the text editor
+void editorDelChar() {
+  // Check if the cursor is at the end of the document or at the very beginning
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    // If the cursor is not at the beginning of the line, delete the character to the left
+    int at = editorRowPrevChar(row, E.cx);
+    editorRowSplice(row, at, E.cx - at, NULL, 0);
+    E.cx = at;
   } else {
     // If the cursor is at the beginning of the line, append the current line to the previous line
+    editorUndoBeginGroup();
     E.cx = E.row[E.cy - 1].size;
     editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
     // Delete the current row and move the cursor up one line
     editorDelRow(E.cy);
+    editorUndoEndGroup();
     E.cy--;
   }
 }
 
 
-/*** file i/o ***/
+/*** compression ***/
+
+// Compressed files are read and written through zlib and libzstd, which
+// are only linked in when asked for (make kilo-z); without them such
+// files are opened read-only in the hex view.
+
+// Function to name a compression format for messages.
+const char *editorCodecName(int type) {
+  return type == CODEC_GZIP ? "gzip" : type == CODEC_ZSTD ? "zstd" : "plain";
+}
+
+// Function to tell whether support for a compression format is built in.
+int editorCodecSupported(int type) {
+#ifdef KILO_GZIP
+  if (type == CODEC_GZIP) return 1;
+#endif
+#ifdef KILO_ZSTD
+  if (type == CODEC_ZSTD) return 1;
+#endif
+  return type == CODEC_NONE;
+}
+
+// Function to recognise compressed data by its magic number.
+int editorCodecDetect(const char *p, size_t len) {
+  const unsigned char *u = (const unsigned char *)p;
+  if (len >= 2 && u[0] == 0x1f && u[1] == 0x8b) return CODEC_GZIP;
+  if (len >= 4 && u[0] == 0x28 && u[1] == 0xb5 && u[2] == 0x2f && u[3] == 0xfd)
+    return CODEC_ZSTD;
+  return CODEC_NONE;
+}
+
+// Function to pick the format a file is saved in from its name, if the
+// format is built in.
+int editorCodecByName(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  int type = CODEC_NONE;
+  if (ext && !strcmp(ext, ".gz")) type = CODEC_GZIP;
+  else if (ext && !strcmp(ext, ".zst")) type = CODEC_ZSTD;
+  return editorCodecSupported(type) ? type : CODEC_NONE;
+}
+
+// Function to set up a codec; encode picks compression. Returns -1 if the
+// format isn't built in.
+int editorCodecOpen(struct editorCodec *c, int type, int encode) {
+  memset(c, 0, sizeof(*c));
+  if (type == CODEC_NONE || !editorCodecSupported(type)) return -1;
+  c->type = type;
+  c->encode = encode;
+#ifdef KILO_GZIP
+  if (type == CODEC_GZIP) {
+    z_stream *z = calloc(1, sizeof(z_stream));
+    // 15 + 32 accepts gzip and zlib headers; 15 + 16 writes gzip.
+    int rc = encode ? deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                                   Z_DEFAULT_STRATEGY)
+                    : inflateInit2(z, 15 + 32);
+    if (rc != Z_OK) {
+      free(z);
+      c->type = CODEC_NONE;
+      return -1;
+    }
+    c->state = z;
+  }
+#endif
+#ifdef KILO_ZSTD
+  if (type == CODEC_ZSTD) {
+    if (encode) {
+      ZSTD_CStream *zc = ZSTD_createCStream();
+      ZSTD_initCStream(zc, KILO_ZSTD_LEVEL);
+      c->state = zc;
+    } else {
+      ZSTD_DStream *zd = ZSTD_createDStream();
+      ZSTD_initDStream(zd);
+      c->state = zd;
+    }
+  }
+#endif
+  return 0;
+}
+
+// Function to release a codec.
+void editorCodecClose(struct editorCodec *c) {
+#ifdef KILO_GZIP
+  if (c->type == CODEC_GZIP) {
+    if (c->encode) deflateEnd(c->state);
+    else inflateEnd(c->state);
+    free(c->state);
+  }
+#endif
+#ifdef KILO_ZSTD
+  if (c->type == CODEC_ZSTD) {
+    if (c->encode) ZSTD_freeCStream(c->state);
+    else ZSTD_freeDStream(c->state);
+  }
+#endif
+  memset(c, 0, sizeof(*c));
+}
+
+// Function to run a codec over some input. *used receives the input bytes
+// consumed; the output produced is returned, or -1 on corrupt data. With
+// finish set, a compressor flushes its last block, and is called again
+// until it returns less than outcap.
+long editorCodecRun(struct editorCodec *c, const char *in, size_t inlen, size_t *used,
+                    char *out, size_t outcap, int finish) {
+  *used = 0;
+  (void)c; (void)in; (void)inlen; (void)out; (void)outcap; (void)finish;
+#ifdef KILO_GZIP
+  if (c->type == CODEC_GZIP) {
+    z_stream *z = c->state;
+    z->next_in = (unsigned char *)in;
+    z->avail_in = inlen;
+    z->next_out = (unsigned char *)out;
+    z->avail_out = outcap;
+    int rc = c->encode ? deflate(z, finish ? Z_FINISH : Z_NO_FLUSH) : inflate(z, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END && !c->encode) {
+      // Concatenated gzip members decode as one stream.
+      if (z->avail_in) inflateReset(z);
+      else c->done = 1;
+    } else if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+      return -1;
+    }
+    *used = inlen - z->avail_in;
+    return outcap - z->avail_out;
+  }
+#endif
+#ifdef KILO_ZSTD
+  if (c->type == CODEC_ZSTD) {
+    ZSTD_inBuffer ib = { in, inlen, 0 };
+    ZSTD_outBuffer ob = { out, outcap, 0 };
+    size_t rc;
+    if (!c->encode) rc = ZSTD_decompressStream(c->state, &ob, &ib);
+    else if (finish) rc = ZSTD_endStream(c->state, &ob);
+    else rc = ZSTD_compressStream(c->state, &ob, &ib);
+    if (ZSTD_isError(rc)) return -1;
+    // 0 means a frame was decoded and flushed in full; more may follow.
+    if (!c->encode && rc == 0 && ib.pos == ib.size) c->done = 1;
+    *used = ib.pos;
+    return ob.pos;
+  }
+#endif
+  return -1;
+}
+
+// Function to decompress a whole buffer into a new allocation. Returns
+// NULL on corrupt or truncated data.
+char *editorDecodeAll(int type, const char *in, size_t inlen, size_t *outlen) {
+  struct editorCodec c;
+  if (editorCodecOpen(&c, type, 0) == -1) return NULL;
+  size_t cap = inlen * 4 + KILO_DECODE_BUF, len = 0;
+  char *out = malloc(cap);
+  while (inlen && !c.done) {
+    if (cap - len < KILO_DECODE_BUF) out = realloc(out, cap *= 2);
+    size_t used;
+    long n = editorCodecRun(&c, in, inlen, &used, out + len, cap - len, 0);
+    if (n == -1 || (n == 0 && used == 0)) break;
+    in += used;
+    inlen -= used;
+    len += n;
+  }
+  // Input that runs out before the end of the stream was cut short.
+  int bad = !c.done;
+  editorCodecClose(&c);
+  if (bad) {
+    free(out);
+    return NULL;
+  }
+  *outlen = len;
+  return out;
+}
+
+/*** raw view ***/
+
+// Binary files and files with lines too long to lay out are not turned
+// into rows. They stay mapped and read-only, and each screen line is made
+// from the mapping as it is drawn: a hex dump of KILO_HEX_BYTES per line,
+// or the visible columns of the file's own lines. The cursor is a line
+// number (cy) and a byte within that line (cx).
+
+// Function to tell from the start of a file whether it needs a raw view:
+// a NUL byte marks it binary, and a line longer than KILO_HUGE_LINE within
+// the first two of them too long to edit as a row.
+int editorRawSniff(const char *p, size_t size) {
+  if (memchr(p, '\0', size < KILO_SNIFF ? size : KILO_SNIFF)) return RAW_HEX;
+  size_t end = size < 2 * (size_t)KILO_HUGE_LINE ? size : 2 * (size_t)KILO_HUGE_LINE;
+  for (size_t at = 0; at < end;) {
+    const char *nl = memchr(p + at, '\n', end - at);
+    size_t next = nl ? (size_t)(nl - p) : end;
+    if (next - at > KILO_HUGE_LINE) return RAW_LINES;
+    at = next + 1;
+  }
+  return RAW_OFF;
+}
+
+// Function to record where another line of a raw view starts.
+void editorRawPush(size_t at) {
+  struct editorRaw *R = &E.raw;
+  if (R->nlines == R->cap) {
+    R->cap = R->cap ? 2 * R->cap : 64;
+    R->starts = realloc(R->starts, sizeof(size_t) * R->cap);
+  }
+  R->starts[R->nlines++] = at;
+}
+
+// Function to find line starts until line 'at' is known to exist or not.
+// Only as much of the file is searched as the lines asked for need.
+void editorRawScan(int at) {
+  struct editorRaw *R = &E.raw;
+  if (R->nlines == 0 && R->size > 0) editorRawPush(0);
+  while (R->nlines <= at && R->scanned < R->size) {
+    const char *nl = memchr(R->data + R->scanned, '\n', R->size - R->scanned);
+    R->scanned = nl ? (size_t)(nl - R->data) + 1 : R->size;
+    if (R->scanned < R->size) editorRawPush(R->scanned);
+  }
+}
+
+// Function to count the lines of a raw view known so far.
+int editorRawLines() {
+  if (E.raw.mode == RAW_HEX) return (E.raw.size + KILO_HEX_BYTES - 1) / KILO_HEX_BYTES;
+  editorRawScan(0);
+  return E.raw.nlines;
+}
+
+// Function to check whether line i of a raw view exists.
+int editorRawHas(int i) {
+  if (i < 0) return 0;
+  if (E.raw.mode == RAW_LINES) editorRawScan(i);
+  return i < editorRawLines();
+}
+
+// Function to get the bytes [*start, *end) of line i of a raw view, which
+// must exist. Line ends are left out.
+void editorRawSpan(int i, size_t *start, size_t *end) {
+  struct editorRaw *R = &E.raw;
+  if (R->mode == RAW_HEX) {
+    *start = (size_t)i * KILO_HEX_BYTES;
+    *end = R->size - *start > KILO_HEX_BYTES ? *start + KILO_HEX_BYTES : R->size;
+    return;
+  }
+  editorRawScan(i + 1);
+  *start = R->starts[i];
+  *end = i + 1 < R->nlines ? R->starts[i + 1] : R->size;
+  if (*end > *start && R->data[*end - 1] == '\n') (*end)--;
+  if (*end > *start && R->data[*end - 1] == '\r') (*end)--;
+}
+
+// Function to get the last cursor position on line i of a raw view: the
+// last byte in the hex dump, just past the end in the line view.
+int editorRawLast(int i) {
+  size_t start, end;
+  if (!editorRawHas(i)) return 0;
+  editorRawSpan(i, &start, &end);
+  if (E.raw.mode == RAW_HEX) return end - start - 1;
+  return end - start;
+}
+
+// Function to get the file offset of the cursor of a raw view.
+long long editorRawOffset() {
+  size_t start, end;
+  if (!editorRawHas(E.cy)) return 0;
+  editorRawSpan(E.cy, &start, &end);
+  return start + E.cx;
+}
+
+// Function to put the cursor of a raw view on byte off of the file.
+void editorRawGoto(long long off) {
+  struct editorRaw *R = &E.raw;
+  E.cy = E.cx = 0;
+  if (R->size == 0) return;
+  if (off < 0) off = 0;
+  if (off >= (long long)R->size) off = R->size - 1;
+  if (R->mode == RAW_HEX) {
+    E.cy = off / KILO_HEX_BYTES;
+    E.cx = off % KILO_HEX_BYTES;
+    return;
+  }
+  while (R->scanned <= (size_t)off && R->scanned < R->size) editorRawScan(R->nlines);
+  int lo = 0, hi = R->nlines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (R->starts[mid] <= (size_t)off) lo = mid;
+    else hi = mid - 1;
+  }
+  E.cy = lo;
+  E.cx = off - R->starts[lo];
+  if (E.cx > editorRawLast(lo)) E.cx = editorRawLast(lo);
+}
+
+// Function to fit the view of the mapping into the int line numbers and
+// columns the cursor and scrolling work with: the hex dump shows up to
+// INT_MAX / 2 lines and the line view up to INT_MAX / 2 bytes, which
+// leaves room for adding screen sizes to them. If that cuts the file
+// short, a message says so.
+void editorRawFit() {
+  struct editorRaw *R = &E.raw;
+  size_t max = INT_MAX / 2;
+  if (R->mode == RAW_HEX) max *= KILO_HEX_BYTES;
+  R->size = R->mapped < max ? R->mapped : max;
+  R->digits = 8;
+  while (R->digits < 16 && R->size > 0 && ((R->size - 1) >> (4 * R->digits))) R->digits++;
+  if (R->size < R->mapped)
+    editorSetStatusMessage("Only the first %zu MB of the file fit the %s view",
+                           R->size >> 20, R->mode == RAW_HEX ? "hex" : "line");
+}
+
+// Function to show the mapped file data in a raw view. The view owns the
+// mapping from here on.
+void editorRawOpen(int mode, char *data, size_t size) {
+  E.raw.mode = mode;
+  E.raw.data = data;
+  E.raw.mapped = size;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  if (mode == RAW_HEX) {
+    editorSetStatusMessage("Binary file: read-only hex view (^X lines, ^G offset)");
+  } else {
+    editorSetStatusMessage("Line over %d KB: read-only line view (^X hex, ^G offset)",
+                           KILO_HUGE_LINE / 1024);
+  }
+  editorRawFit();
+}
+
+// Function to switch a raw view between the hex dump and the line view,
+// keeping the cursor on the same byte.
+void editorRawToggle() {
+  long long off = editorRawOffset();
+  E.raw.mode = E.raw.mode == RAW_HEX ? RAW_LINES : RAW_HEX;
+  E.coloff = 0;
+  editorSetStatusMessage("Read-only %s view; ^X switches back",
+                         E.raw.mode == RAW_HEX ? "hex" : "line");
+  editorRawFit();
+  editorRawGoto(off);
+}
+
+// Function to unmap the file of a raw view and go back to rows.
+void editorRawClose() {
+  if (E.raw.data) munmap(E.raw.data, E.raw.mapped);
+  free(E.raw.starts);
+  memset(&E.raw, 0, sizeof(E.raw));
+}
+
+/*** file loading ***/
+
+// Struct to describe the part of a file one loader thread turns into rows.
+struct loadChunk {
+  const char *start;        // First byte of the chunk, at the start of a line.
+  const char *end;          // End of the chunk, just past a newline or at EOF.
+  int first;                // Index of the chunk's first row.
+  int rows;                 // Number of rows in the chunk.
+  int in_comment;           // Whether the chunk starts inside a multi-line comment.
+  struct rowPool pool;      // Pool the chunk's row buffers are carved from.
+#ifdef KILO_PROFILE
+  struct profFrame prof;    // Allocations and highlighting done for the chunk.
+#endif
+};
+
+// Function to count the rows of a chunk, including a last line without newline.
+void *editorLoadCount(void *arg) {
+  struct loadChunk *c = arg;
+  const char *p = c->start;
+  int rows = 0;
+  while (p < c->end && (p = memchr(p, '\n', c->end - p)) != NULL) {
+    rows++;
+    p++;
+  }
+  if (c->end > c->start && c->end[-1] != '\n') rows++;
+  c->rows = rows;
+  return NULL;
+}
+
+// Function to build the rows of a chunk straight into E.row. Highlighting
+// starts from the chunk's in_comment guess; editorLoadStep fixes up wrong
+// guesses once every chunk is done.
+void *editorLoadBuild(void *arg) {
+  struct loadChunk *c = arg;
+  PROF_THREAD(&c->prof);
+  unsigned char *hl = NULL;
+  int hlcap = 0;
+  int in_comment = c->in_comment;
+  const char *p = c->start;
+
+  for (int k = 0; k < c->rows; k++) {
+    const char *nl = memchr(p, '\n', c->end - p);
+    const char *next = nl ? nl + 1 : c->end;
+    int len = next - p;
+    while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) len--;
+
+    erow *row = &E.row[c->first + k];
+    row->idx = c->first + k;
+    row->size = len;
+    row->tabs = editorCountTabs(p, len);
+    row->utf8 = !editorIsAscii(p, len);
+    row->chars = editorPoolAlloc(&c->pool, len + 1 + 32);
+    memcpy(row->chars, p, len);
+    row->chars[len] = '\0';
+    row->rxmap = NULL;
+    row->wrap = NULL;
+    row->hl_open_comment = 0;
+    editorRowLayout(&c->pool, row);
+
+    if (row->rsize > hlcap) {
+      hlcap = row->rsize > 2 * hlcap ? row->rsize : 2 * hlcap;
+      hl = realloc(hl, hlcap);
+    }
+    memset(hl, HL_NORMAL, row->rsize);
+    if (E.syntax) {
+      in_comment = editorHighlight(row->render, row->rsize, in_comment, hl);
+      row->hl_open_comment = in_comment;
+    }
+    editorRowHlStore(&c->pool, row, hl);
+    PROF_COUNT(rows_hl, 1);
+    p = next;
+  }
+  free(hl);
+  PROF_THREAD(NULL);
+  return NULL;
+}
+
+// Function to run fn on every chunk, one thread per chunk. The first chunk
+// runs on the calling thread.
+void editorLoadRun(void *(*fn)(void *), struct loadChunk *chunk, int n) {
+  pthread_t tid[KILO_LOAD_THREADS];
+  int started[KILO_LOAD_THREADS] = {0};
+  for (int k = 1; k < n; k++)
+    started[k] = pthread_create(&tid[k], NULL, fn, &chunk[k]) == 0;
+  fn(&chunk[0]);
+  for (int k = 1; k < n; k++) {
+    if (started[k]) pthread_join(tid[k], NULL);
+    else fn(&chunk[k]);
+  }
+  for (int k = 0; k < n; k++) PROF_MERGE(&chunk[k].prof);
+}
+
+// Function to turn the complete lines in [data, end) into rows appended to
+// E.row. They are split at line boundaries into chunks that are counted,
+// then built, in parallel.
+void editorLoadLines(const char *data, const char *end) {
+  size_t size = end - data;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > KILO_LOAD_THREADS) n = KILO_LOAD_THREADS;
+  if (n > (long)(size / KILO_LOAD_MIN_CHUNK)) n = size / KILO_LOAD_MIN_CHUNK;
+  if (n < 1) n = 1;
+
+  struct loadChunk chunk[KILO_LOAD_THREADS];
+  memset(chunk, 0, sizeof(chunk));
+  const char *p = data;
+  for (int k = 0; k < n; k++) {
+    chunk[k].start = p;
+    const char *target = data + size / n * (k + 1);
+    if (k == n - 1 || target < p) target = end;
+    const char *nl = target < end ? memchr(target, '\n', end - target) : NULL;
+    p = nl ? nl + 1 : end;
+    chunk[k].end = p;
+  }
+  // Only the first chunk knows the comment state it starts in.
+  if (E.numrows > 0) chunk[0].in_comment = E.row[E.numrows - 1].hl_open_comment;
+
+  editorLoadRun(editorLoadCount, chunk, n);
+  int total = E.numrows;
+  for (int k = 0; k < n; k++) {
+    chunk[k].first = total;
+    total += chunk[k].rows;
+  }
+
+  E.row = realloc(E.row, sizeof(erow) * total);
+  editorSlabClass(0); // Builds the shared class table before threads use it.
+  if (W.nblocks == 0) editorWidthInit(); // And the width table, which tabs need.
+  editorLoadRun(editorLoadBuild, chunk, n);
+  E.numrows = total;
+  for (int k = 0; k < n; k++) editorRowPoolMerge(&E.pool, &chunk[k].pool);
+
+  // Re-highlight chunks that really start inside a comment; the cascade
+  // stops as soon as a row's comment state agrees with what was assumed.
+  for (int k = 1; k < n; k++) {
+    int first = chunk[k].first;
+    if (E.syntax && first > 0 && first < total && E.row[first - 1].hl_open_comment)
+      editorUpdateSyntax(&E.row[first]);
+  }
+}
+
+// Function to decompress at least max more bytes of a compressed file, up
+// to a line end, and turn them into rows. The part of the last line that
+// has been decompressed so far waits in L->out. Returns the bytes used.
+// The codec is run until it reports the end of the stream, since it may
+// still hold output after taking the last input; if it stops short of
+// that the file is corrupt or cut off, and the buffer is marked damaged.
+size_t editorLoadDecoded(size_t max) {
+  struct editorLoader *L = &E.load;
+  size_t nl = 0; // Just past the last newline in out, or 0.
+  while (!L->dec.done && (L->outlen < max || nl == 0)) {
+    if (L->outcap - L->outlen < KILO_DECODE_BUF) {
+      L->outcap = L->outcap * 2 + KILO_DECODE_BUF;
+      L->out = realloc(L->out, L->outcap);
+    }
+    size_t used;
+    long n = editorCodecRun(&L->dec, L->data + L->pos, L->size - L->pos, &used,
+                            L->out + L->outlen, L->outcap - L->outlen, 0);
+    if (n == -1 || (n == 0 && used == 0)) {
+      editorSetStatusMessage("%s data is %s; loaded what could be read",
+                             editorCodecName(L->dec.type),
+                             n != -1 && L->pos == L->size ? "cut short" : "damaged");
+      E.damaged = 1;
+      L->dec.done = 1;
+      break;
+    }
+    char *q = memrchr(L->out + L->outlen, '\n', n);
+    if (q) nl = q - L->out + 1;
+    L->pos += used;
+    L->outlen += n;
+  }
+  if (L->dec.done) L->pos = L->size;
+
+  // At the end everything left is the last line, newline or not.
+  size_t take = L->dec.done ? L->outlen : nl;
+  editorLoadLines(L->out, L->out + take);
+  memmove(L->out, L->out + take, L->outlen - take);
+  L->outlen -= take;
+  return take;
+}
+
+// Function to turn the next part of the file into rows appended to E.row.
+// At least max bytes are taken, rounded up to a line end. Returns 1 while
+// more of the file remains to be loaded.
+int editorLoadStep(size_t max) {
+  struct editorLoader *L = &E.load;
+  if (L->data == NULL) return 0;
+  long long start = editorNowNs();
+  size_t size;
+  if (L->dec.type) {
+    size = editorLoadDecoded(max);
+  } else {
+    const char *data = L->data + L->pos;
+    const char *end = L->data + L->size;
+    if (L->size - L->pos > max) {
+      const char *nl = memchr(data + max, '\n', end - (data + max));
+      end = nl ? nl + 1 : end;
+    }
+    editorLoadLines(data, end);
+    size = end - data;
+    L->pos = end - L->data;
+  }
+
+  if (L->pos < L->size || (L->dec.type && !L->dec.done)) {
+    // Size the next slice so it keeps the editor responsive.
+    long long ns = editorNowNs() - start + 1;
+    double next = (double)size * KILO_LOAD_SLICE_MS * 1000000 / ns;
+    L->step = next < KILO_LOAD_FIRST ? KILO_LOAD_FIRST :
+              next > KILO_LOAD_STEP_MAX ? KILO_LOAD_STEP_MAX : next;
+    return 1;
+  }
+  editorLoadCancel();
+  return 0;
+}
+
+// Function to stop loading and unmap the file; rows loaded so far stay.
+void editorLoadCancel() {
+  if (E.load.data) munmap(E.load.data, E.load.size);
+  if (E.load.dec.type) editorCodecClose(&E.load.dec);
+  free(E.load.out);
+  memset(&E.load, 0, sizeof(E.load));
+}
+
+// Function to load the file until row 'at' exists or the file is done.
+void editorLoadUntil(int at) {
+  while (E.numrows <= at && editorLoadStep(E.load.step));
+}
+
+// Function to load whatever is left of the file.
+void editorLoadFinish() {
+  editorLoadUntil(INT_MAX);
+}
+
+// Function to map the first size bytes of a file and queue everything from
+// byte 'from' on to be appended as rows. Returns -1 if it can't be mapped.
+int editorLoadMap(int fd, size_t size, size_t from) {
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) return -1;
+  madvise(data + from / KILO_PAGE * KILO_PAGE, size - from / KILO_PAGE * KILO_PAGE,
+          MADV_SEQUENTIAL);
+
+  E.load.data = data;
+  E.load.size = size;
+  E.load.pos = from;
+  E.load.step = KILO_LOAD_FIRST;
+  return 0;
+}
+
+// Function to start loading a regular file into an empty buffer. The file
+// is mapped and only enough of it to fill the first screen is loaded here;
+// the rest follows in slices between keypresses. gzip and zstd files are
+// decompressed on the way when support for them is built in. Returns -1 if the file
+// can't be mapped, so the caller can read it as a stream instead.
+int editorLoad(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+  if (st.st_size == 0) return 0;
+  if (editorLoadMap(fd, st.st_size, 0) == -1) return -1;
+
+  // Compressed files are decompressed as they are loaded.
+  int type = editorCodecDetect(E.load.data, E.load.size);
+  if (type != CODEC_NONE && editorCodecOpen(&E.load.dec, type, 0) == 0) {
+    E.codec = type;
+  } else if (!E.batch) {
+    // Binary files, compressed ones that can't be decompressed here and
+    // huge lines are shown straight from the mapping, so saving can't
+    // mangle them. Scripts always get rows, since their commands work on
+    // those.
+    int mode = type != CODEC_NONE ? RAW_HEX : editorRawSniff(E.load.data, E.load.size);
+    if (mode != RAW_OFF) {
+      editorRawOpen(mode, E.load.data, E.load.size);
+      if (type != CODEC_NONE)
+        editorSetStatusMessage("This is a %s file; build kilo-z to edit it",
+                               editorCodecName(type));
+      memset(&E.load, 0, sizeof(E.load));
+      return 0;
+    }
+  } else if (type != CODEC_NONE) {
+    // The rows hold the compressed bytes, which a save would mangle.
+    E.undecoded = type;
+    editorSetStatusMessage("This is a %s file; build kilo-z to decompress it",
+                           editorCodecName(type));
+  }
+  while (E.numrows <= E.rowoff + E.screenrows && editorLoadStep(KILO_LOAD_FIRST));
+  return 0;
+}
+
+/*** file i/o ***/
+
+// Function to convert editor rows to a single string, suitable for saving to a file
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+
+  // Calculate the total length needed to store all rows
+  for (j = 0; j < E.numrows; j++)
+    totlen += E.row[j].size + 1;
+  *buflen = totlen;
+
+  // Allocate memory for the string
+  char *buf = malloc(totlen);
+  char *p = buf;
+
+  // Copy each row and append a newline character
+  for (j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+// Struct to stream output through a fixed-size buffer.
+struct editorWriter {
+  int fd;                   // Destination file descriptor.
+  char buf[KILO_SAVE_BUF];  // Bytes not yet handed to write().
+  size_t used;              // Number of bytes in buf.
+  long long total;          // Bytes accepted so far.
+  long long disk;           // Bytes written to fd, after compression.
+  int err;                  // Set once a write failed.
+  struct editorCodec enc;   // Compressor the bytes go through, if any.
+};
+
+// Function to write a whole block, retrying on short writes and interrupts.
+int editorWriteAll(int fd, const char *s, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, s, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Function to write bytes out, compressing them first if the writer
+// compresses. With finish set the compressor writes its last block.
+void editorWriterEmit(struct editorWriter *w, const char *s, size_t len, int finish) {
+  if (w->err) return;
+  if (w->enc.type == CODEC_NONE) {
+    if (editorWriteAll(w->fd, s, len) == -1) w->err = 1;
+    w->disk += len;
+    return;
+  }
+  char out[KILO_DECODE_BUF];
+  for (;;) {
+    size_t used;
+    long n = editorCodecRun(&w->enc, s, len, &used, out, sizeof(out), finish);
+    if (n == -1 || editorWriteAll(w->fd, out, n) == -1) {
+      w->err = 1;
+      return;
+    }
+    w->disk += n;
+    s += used;
+    len -= used;
+    if (len == 0 && (size_t)n < sizeof(out)) return;
+  }
+}
+
+// Function to hand the buffered bytes of a writer to the file.
+void editorWriterFlush(struct editorWriter *w) {
+  if (w->used) editorWriterEmit(w, w->buf, w->used, 0);
+  w->used = 0;
+}
+
+// Function to add bytes to a writer; large pieces bypass the buffer.
+void editorWriterPut(struct editorWriter *w, const char *s, size_t len) {
+  w->total += len;
+  if (w->used + len > sizeof(w->buf)) editorWriterFlush(w);
+  if (len >= sizeof(w->buf)) {
+    editorWriterEmit(w, s, len, 0);
+    return;
+  }
+  memcpy(&w->buf[w->used], s, len);
+  w->used += len;
+}
+
+// Function to stream all rows to a file descriptor in constant memory,
+// compressed in the given format. Returns the number of bytes written, or
+// -1 on an I/O error.
+long long editorWriteRows(int fd, int codec) {
+  struct editorWriter *w = malloc(sizeof(*w));
+  w->fd = fd;
+  w->used = 0;
+  w->total = 0;
+  w->disk = 0;
+  w->err = 0;
+  if (editorCodecOpen(&w->enc, codec, 1) == -1) w->enc.type = CODEC_NONE;
+
+  for (int j = 0; j < E.numrows; j++) {
+    editorWriterPut(w, E.row[j].chars, E.row[j].size);
+    editorWriterPut(w, "\n", 1);
+  }
+  editorWriterFlush(w);
+  if (w->enc.type) {
+    editorWriterEmit(w, "", 0, 1);
+    editorCodecClose(&w->enc);
+  }
+
+  long long total = w->err ? -1 : w->disk;
+  free(w);
+  return total;
+}
+
+// Function to write the buffer to a temporary file next to 'filename',
+// fsync it and rename it over the original, so a crash never leaves a
+// half-written file behind. A symlink stays in place and the file it
+// points to is replaced. Returns the bytes written or -1 with errno set.
+long long editorWriteFileAtomic(char *filename) {
+  editorLoadFinish();
+  char *target = realpath(filename, NULL);
+  if (target == NULL) {
+    if (errno != ENOENT) return -1;
+    target = strdup(filename); // A new file.
+  }
+  char *tmp = editorSiblingPath(target, ".XXXXXX");
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    int saved = errno;
+    free(tmp);
+    free(target);
+    errno = saved;
+    return -1;
+  }
+
+  // Keep the owner and permissions of the file being replaced, or the
+  // usual 0644. Only root may give a file away; for anyone else the new
+  // file is theirs, as with any editor that writes a fresh copy.
+  struct stat st;
+  if (stat(target, &st) == 0) {
+    if (fchown(fd, st.st_uid, st.st_gid) == -1) errno = 0;
+    fchmod(fd, st.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+  }
+
+  // Files opened compressed stay compressed; others follow their name.
+  int codec = editorCodecByName(filename);
+  if (codec == CODEC_NONE && E.filename && !strcmp(filename, E.filename)) codec = E.codec;
+  long long len = editorWriteRows(fd, codec);
+  // The descriptor is closed exactly once, whatever fails first.
+  int failed = len == -1 || fsync(fd) == -1;
+  int saved = errno;
+  if (close(fd) == -1 && !failed) {
+    failed = 1;
+    saved = errno;
+  }
+  if (failed || rename(tmp, target) == -1) {
+    if (!failed) saved = errno;
+    unlink(tmp);
+    free(tmp);
+    free(target);
+    errno = saved;
+    return -1;
+  }
+  free(tmp);
+
+  // Make the rename itself durable.
+  char *slash = strrchr(target, '/');
+  char *dir = slash ? strndup(target, slash - target + 1) : strdup(".");
+  int dfd = open(dir, O_RDONLY);
+  if (dfd != -1) {
+    fsync(dfd);
+    close(dfd);
+  }
+  free(dir);
+  free(target);
+  return len;
+}
+
+// Function to open a file in the text editor
+void editorOpen(char *filename) {
+  // Free the current filename and set it to the new one
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  // Select syntax highlighting based on the file's extension
+  editorSelectSyntaxHighlight();
+
+  // Open the file for reading
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  // Loading is not an edit, so keep it out of the undo log
+  E.undo.suspended++;
+  if (editorLoad(fd) == -1) {
+    // Files that can't be mapped are read line by line instead
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+      while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                             line[linelen - 1] == '\r'))
+        linelen--;
+      editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+  } else {
+    // The mapping outlives the descriptor; scripted runs load up front.
+    close(fd);
+    if (E.batch) editorLoadFinish();
+  }
+  E.undo.suspended--;
+  editorUndoReset();
+  E.dirty = 0;
+
+  editorDiskSync();
+  // Raw views can't be edited, so there is nothing to journal.
+  if (E.raw.mode) return;
+
+  // Bring back edits that a crashed session left in the journal.
+  off_t valid = 0;
+  int recovered = editorJournalReplay(&valid);
+  if (recovered > 0) {
+    E.dirty = recovered;
+    editorSetStatusMessage("Recovered %d edits from the journal", recovered);
+  }
+  editorJournalStart(recovered > 0 ? valid : 0);
+}
+
+// Function to save the current editor content to a file
+void editorSave() {
+  if (E.filename == NULL) {
+    // If there is no filename, prompt the user for a new one
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    // Select syntax highlighting based on the new filename's extension
+    editorSelectSyntaxHighlight();
+  } else if (editorDiskChanged()) {
+    // Don't silently throw away what another program wrote.
+    editorSetStatusMessage("%.20s changed on disk. Overwrite it? (y/n)", E.filename);
+    editorRefreshScreen();
+    if (editorReadKey() != 'y') {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  } else if (E.damaged) {
+    // Only part of the file could be decompressed; the rest would be lost.
+    editorSetStatusMessage("%.20s was only partly read. Overwrite it? (y/n)", E.filename);
+    editorRefreshScreen();
+    if (editorReadKey() != 'y') {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  long long len = editorWriteFileAtomic(E.filename);
+  if (len != -1) {
+    E.dirty = 0;
+    E.damaged = 0;
+    editorJournalStart(0);
+    editorFollowSync();
+    editorDiskSync();
+    editorSetStatusMessage("%lld bytes written to disk", len);
+    return;
+  }
+
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+
+/*** follow ***/
+
+// Function to find where the last line of a file that doesn't end in a
+// newline starts, by scanning back from its end.
+off_t editorFollowTailStart(int fd, off_t size) {
+  char buf[4096];
+  off_t end = size;
+  while (end > 0) {
+    off_t start = end > (off_t)sizeof(buf) ? end - (off_t)sizeof(buf) : 0;
+    ssize_t n = pread(fd, buf, end - start, start);
+    if (n <= 0) break;
+    char *nl = memrchr(buf, '\n', n);
+    if (nl) return start + (nl - buf) + 1;
+    end = start;
+  }
+  return 0;
+}
+
+// Function to start following the open file: lines appended to it are
+// added to the buffer as they arrive. The file's directory is watched so
+// rotation (a new file under the same name) is noticed too.
+void editorFollowStart() {
+  if (E.filename == NULL || E.follow.fd != -1) return;
+  if (E.codec != CODEC_NONE) {
+    editorSetStatusMessage("Can't follow a %s file", editorCodecName(E.codec));
+    return;
+  }
+  if (E.raw.mode) {
+    editorSetStatusMessage("Can't follow a file in the %s view",
+                           E.raw.mode == RAW_HEX ? "hex" : "line");
+    return;
+  }
+  char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+  E.follow.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.follow.fd == -1 ||
+      inotify_add_watch(E.follow.fd, dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1) {
+    editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+    if (E.follow.fd != -1) close(E.follow.fd);
+    E.follow.fd = -1;
+    free(dir);
+    return;
+  }
+  free(dir);
+  E.follow.name = strdup(slash ? slash + 1 : E.filename);
+
+  // Everything up to the current size is being loaded already.
+  struct stat st;
+  E.follow.ino = stat(E.filename, &st) == 0 ? st.st_ino : 0;
+  E.follow.size = E.load.data ? (off_t)E.load.size : E.follow.ino ? st.st_size : 0;
+  E.follow.tail = -1;
+  if (E.follow.size > 0) {
+    int fd = open(E.filename, O_RDONLY);
+    char last = '\n';
+    if (fd != -1 && pread(fd, &last, 1, E.follow.size - 1) == 1 && last != '\n')
+      E.follow.tail = editorFollowTailStart(fd, E.follow.size);
+    if (fd != -1) close(fd);
+  }
+}
+
+// Function to note that the file now matches the buffer, e.g. after a save,
+// so the change that caused isn't read back as new lines.
+void editorFollowSync() {
+  struct stat st;
+  if (E.follow.fd == -1 || stat(E.filename, &st) == -1) return;
+  E.follow.ino = st.st_ino;
+  E.follow.size = st.st_size;
+  E.follow.tail = -1;
+}
+
+// Function to drop the last row without recording it as an edit.
+void editorFollowDropTail() {
+  int at = E.numrows - 1;
+  editorTriIndexDelete(at, 1);
+  editorLineIndexTruncate(at);
+  editorFreeRow(&E.row[at]);
+  E.numrows--;
+}
+
+// Function to tell whether the last row still holds the unfinished last
+// line of the file as it was read, bytes E.follow.tail up to
+// E.follow.size, so it can be replaced by the line in full.
+int editorFollowTailKept(int fd) {
+  if (E.numrows == 0) return 0;
+  size_t n = E.follow.size - E.follow.tail;
+  char *buf = malloc(n ? n : 1);
+  int kept = pread(fd, buf, n, E.follow.tail) == (ssize_t)n;
+  if (kept) {
+    const char *next;
+    kept = editorRowIs(&E.row[E.numrows - 1], buf, editorLineSpan(buf, buf + n, &next));
+  }
+  free(buf);
+  return kept;
+}
+
+// Function to pick up whatever was appended to the file since the last
+// call. A file that shrank or was replaced is read again from the start.
+void editorFollowRead() {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return; // Rotated away and not recreated yet.
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (st.st_size == E.follow.size && st.st_ino == E.follow.ino)) {
+    close(fd);
+    return;
+  }
+
+  int at_end = E.cy >= E.numrows - 1;
+  if (st.st_ino != E.follow.ino || st.st_size < E.follow.size) {
+    // Edits can't be carried over to different contents.
+    if (E.dirty) {
+      editorSetStatusMessage("%s was %s; stopped following", E.filename,
+                             st.st_ino != E.follow.ino ? "replaced" : "truncated");
+      close(fd);
+      close(E.follow.fd);
+      E.follow.fd = -1;
+      return;
+    }
+    editorSetStatusMessage("%s was %s; reading it again", E.filename,
+                           st.st_ino != E.follow.ino ? "replaced" : "truncated");
+    editorFreeAllRows();
+    editorUndoReset();
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    E.follow.ino = st.st_ino;
+    E.follow.size = 0;
+    E.follow.tail = -1;
+  }
+
+  // A last line still waiting for its newline is read again in full,
+  // unless it was edited: then the rest of it has nowhere to go.
+  off_t from = E.follow.size;
+  if (E.follow.tail != -1) {
+    if (!editorFollowTailKept(fd)) {
+      editorSetStatusMessage("The last line of %.30s was edited; stopped following",
+                             E.filename);
+      close(fd);
+      close(E.follow.fd);
+      E.follow.fd = -1;
+      return;
+    }
+    editorFollowDropTail();
+    from = E.follow.tail;
+  }
+  if (st.st_size == 0 || editorLoadMap(fd, st.st_size, from) == -1) {
+    close(fd);
+    E.follow.size = st.st_size;
+    return;
+  }
+  E.follow.tail = -1;
+  if (E.load.data[st.st_size - 1] != '\n') {
+    char *nl = memrchr(E.load.data + from, '\n', st.st_size - from);
+    E.follow.tail = nl ? nl - E.load.data + 1 : from;
+  }
+  E.follow.size = st.st_size;
+  close(fd);
+
+  // Appends are usually small enough to take in one go.
+  E.undo.suspended++;
+  editorLoadFinish();
+  E.undo.suspended--;
+
+  if (!E.dirty) editorJournalStart(0);
+  else editorJournalRebase();
+  editorDiskSync();
+  if (at_end && E.numrows > 0) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+}
+
+// Function to check the watch for changes to the followed file. Nothing is
+// read unless inotify reported a change under the file's name.
+void editorFollowTick() {
+  if (E.follow.fd == -1 || E.load.data) return;
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  ssize_t n;
+  while ((n = read(E.follow.fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len && !strcmp(ev->name, E.follow.name)) changed = 1;
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+  if (!changed) return;
+
+  editorFollowRead();
+  if (!E.batch) editorRefreshScreen();
+}
 
-// Function to convert editor rows to a single string, suitable for saving to a file
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
+/*** reload ***/
 
-  // Calculate the total length needed to store all rows
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
+// Function to read the identity of the open file into a disk record.
+// Returns -1 if the file can't be stat'ed.
+int editorDiskStat(struct editorDisk *d) {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1) return -1;
+  d->size = st.st_size;
+  d->mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  d->ino = st.st_ino;
+  return 0;
+}
 
-  // Allocate memory for the string
-  char *buf = malloc(totlen);
-  char *p = buf;
+// Function to remember the file on disk as matching what was read or written.
+void editorDiskSync() {
+  if (editorDiskStat(&E.disk) == -1) memset(&E.disk, 0, sizeof(E.disk));
+  E.disk.checked = editorNowMs();
+  E.disk.warned = 0;
+}
 
-  // Copy each row and append a newline character
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// Function to tell whether another program changed the file since then.
+int editorDiskChanged() {
+  struct editorDisk now;
+  if (E.disk.ino == 0 || editorDiskStat(&now) == -1) return 0;
+  return now.size != E.disk.size || now.mtime != E.disk.mtime || now.ino != E.disk.ino;
+}
+
+// Function to hash a line for the reload diff (64-bit FNV-1a).
+unsigned long long editorLineHash(const char *s, int len) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Function to get the length of a line starting at p, up to but not
+// including its newline, with trailing '\r's dropped as the loader does.
+// *next receives the start of the following line.
+int editorLineSpan(const char *p, const char *end, const char **next) {
+  const char *nl = memchr(p, '\n', end - p);
+  *next = nl ? nl + 1 : end;
+  int len = *next - p;
+  while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r')) len--;
+  return len;
+}
+
+// Function to tell whether a row holds exactly the given line.
+int editorRowIs(erow *row, const char *s, int len) {
+  return row->size == len && !memcmp(row->chars, s, len);
+}
+
+// Struct to describe the rows that differ in the middle part of a reload.
+struct reloadSide {
+  int n;                    // Number of lines.
+  const char **s;           // Start of each line.
+  int *len;                 // Length of each line.
+  unsigned long long *hash; // Hash of each line.
+  char *changed;            // Set for lines deleted (old side) or inserted (new side).
+};
+
+// Function to compare line i of a with line j of b.
+int editorReloadEq(struct reloadSide *a, int i, struct reloadSide *b, int j) {
+  return a->hash[i] == b->hash[j] && a->len[i] == b->len[j] &&
+         !memcmp(a->s[i], b->s[j], a->len[i]);
+}
+
+// Function to mark the lines that differ between a[a0, a1) and b[b0, b1)
+// with the greedy Myers diff. Returns -1, marking nothing, if that takes
+// more than KILO_RELOAD_MAX_D deleted and inserted lines.
+int editorReloadMyers(struct reloadSide *a, int a0, int a1,
+                      struct reloadSide *b, int b0, int b1) {
+  int N = a1 - a0, M = b1 - b0;
+  int maxd = N + M < KILO_RELOAD_MAX_D ? N + M : KILO_RELOAD_MAX_D;
+  // V of step d holds the furthest x on diagonals -d..d, at d * d + k + d.
+  int *v = malloc(sizeof(int) * (size_t)(maxd + 1) * (maxd + 1));
+  int D = -1;
+
+  for (int d = 0; d <= maxd && D == -1; d++) {
+    int *cur = &v[d * d + d];
+    int *prev = d ? &v[(d - 1) * (d - 1) + d - 1] : NULL;
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (d == 0) x = 0;
+      else if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) x = prev[k + 1];
+      else x = prev[k - 1] + 1;
+      int y = x - k;
+      while (x < N && y < M && editorReloadEq(a, a0 + x, b, b0 + y)) {
+        x++;
+        y++;
+      }
+      cur[k] = x;
+      if (x >= N && y >= M) {
+        D = d;
+        break;
+      }
+    }
   }
 
-  return buf;
+  // Walk the path back, marking the line each step deleted or inserted.
+  int x = N, y = M;
+  for (int d = D; d > 0; d--) {
+    int *prev = &v[(d - 1) * (d - 1) + d - 1];
+    int k = x - y;
+    int pk = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+    int px = prev[pk];
+    int py = px - pk;
+    if (pk == k + 1) b->changed[b0 + py] = 1;
+    else a->changed[a0 + px] = 1;
+    x = px;
+    y = py;
+  }
+  free(v);
+  return D;
 }
 
-// Function to open a file in the text editor
-void editorOpen(char *filename) {
-  // Free the current filename and set it to the new one
-  free(E.filename);
-  E.filename = strdup(filename);
+// Function to diff a gap between anchors, giving up on it as a whole if
+// it is too different.
+void editorReloadGap(struct reloadSide *a, int a0, int a1,
+                     struct reloadSide *b, int b0, int b1) {
+  if (editorReloadMyers(a, a0, a1, b, b0, b1) != -1) return;
+  memset(&a->changed[a0], 1, a1 - a0);
+  memset(&b->changed[b0], 1, b1 - b0);
+}
 
-  // Select syntax highlighting based on the file's extension
-  editorSelectSyntaxHighlight();
+// Function to mark the lines that differ between a and b. Edits scattered
+// too widely for one Myers pass are split up at lines that occur exactly
+// once on each side (as patience diff does), in the longest run that keeps
+// their order, and the gaps between those anchors are diffed separately.
+void editorReloadDiff(struct reloadSide *a, struct reloadSide *b) {
+  if (editorReloadMyers(a, 0, a->n, b, 0, b->n) != -1) return;
+
+  // Count each line hash on both sides in an open-addressed table.
+  int cap = 1;
+  while (cap < 2 * (a->n + b->n)) cap *= 2;
+  struct { unsigned long long hash; int na, nb, pa, pb; } *tab = calloc(cap, sizeof(*tab));
+  struct reloadSide *sides[2] = { a, b };
+  for (int s = 0; s < 2; s++) {
+    for (int i = 0; i < sides[s]->n; i++) {
+      unsigned long long h = sides[s]->hash[i];
+      int slot = h & (cap - 1);
+      while ((tab[slot].na || tab[slot].nb) && tab[slot].hash != h) slot = (slot + 1) & (cap - 1);
+      tab[slot].hash = h;
+      if (s == 0) {
+        tab[slot].na++;
+        tab[slot].pa = i;
+      } else {
+        tab[slot].nb++;
+        tab[slot].pb = i;
+      }
+    }
+  }
 
-  // Open the file for reading
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+  // Anchors in a's order; keep the longest run increasing in b (patience sort).
+  int *ax = malloc(sizeof(int) * (a->n + 1));
+  int *bx = malloc(sizeof(int) * (a->n + 1));
+  int *pile = malloc(sizeof(int) * (a->n + 1));
+  int *link = malloc(sizeof(int) * (a->n + 1));
+  int na = 0, piles = 0;
+  for (int i = 0; i < a->n; i++) {
+    unsigned long long h = a->hash[i];
+    int slot = h & (cap - 1);
+    while (tab[slot].hash != h) slot = (slot + 1) & (cap - 1);
+    if (tab[slot].na != 1 || tab[slot].nb != 1) continue;
+    if (!editorReloadEq(a, i, b, tab[slot].pb)) continue;
+    ax[na] = i;
+    bx[na] = tab[slot].pb;
+    int lo = 0, hi = piles;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (bx[pile[mid]] < bx[na]) lo = mid + 1;
+      else hi = mid;
+    }
+    link[na] = lo ? pile[lo - 1] : -1;
+    pile[lo] = na;
+    if (lo == piles) piles++;
+    na++;
+  }
+  free(tab);
+
+  // Follow the links back from the last pile, then diff between anchors.
+  int n = 0;
+  for (int k = piles ? pile[piles - 1] : -1; k != -1; k = link[k]) pile[n++] = k;
+  int pa = 0, pb = 0;
+  for (int k = n - 1; k >= -1; k--) {
+    int ea = k >= 0 ? ax[pile[k]] : a->n;
+    int eb = k >= 0 ? bx[pile[k]] : b->n;
+    editorReloadGap(a, pa, ea, b, pb, eb);
+    pa = ea + 1;
+    pb = eb + 1;
+  }
+  free(ax);
+  free(bx);
+  free(pile);
+  free(link);
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// Function to apply the hunks of a reload. Each hunk is four ints: first
+// old row (counted from 'pre'), rows deleted, first new line and lines
+// inserted. Replaced rows are rewritten in place; the rows that come or go
+// are recorded in the undo log one at a time but moved in a single pass
+// over the row array. The cursor row keeps its text if outside a hunk.
+void editorReloadApply(int *hunk, int nh, int pre, struct reloadSide *b) {
+  int grow = 0, first = -1;
+  // The row a search highlighted may be replaced below.
+  editorFindDrop();
+  for (int h = nh - 1; h >= 0; h--) {
+    int at = pre + hunk[h * 4], k = hunk[h * 4 + 1], m = hunk[h * 4 + 3];
+    const char **s = &b->s[hunk[h * 4 + 2]];
+    int *len = &b->len[hunk[h * 4 + 2]];
+    int r = k < m ? k : m;
+    for (int i = 0; i < r; i++) {
+      erow *row = &E.row[at + i];
+      editorRowSplice(row, 0, row->size, (char *)s[i], len[i]);
+    }
+    // Back to front, so these positions are right when replayed in order.
+    for (int i = r; i < k; i++)
+      editorUndoRecordRow(UNDO_ROW_DEL, at + r, E.row[at + i].chars, E.row[at + i].size);
+    for (int i = r; i < m; i++)
+      editorUndoRecordRow(UNDO_ROW_INS, at + i, (char *)s[i], len[i]);
+
+    if (E.cy >= at + k) E.cy += m - k;
+    else if (E.cy >= at + m) E.cy = at + m;
+    if (k != m) {
+      grow += m - k;
+      first = at + r;
+    }
+  }
+  if (first == -1) return;
+
+  // Move the search index over the rows that come and go, front to back.
+  int shift = 0;
+  for (int h = 0; h < nh; h++) {
+    int at = pre + hunk[h * 4] + shift, k = hunk[h * 4 + 1], m = hunk[h * 4 + 3];
+    int r = k < m ? k : m;
+    shift += m - k;
+    editorTriIndexDelete(at + r, k - r);
+    editorTriIndexInsert(at + r, m - r);
+  }
+  editorLineIndexTruncate(first);
+  int total = E.numrows + grow;
+  erow *rows = malloc(sizeof(erow) * (total ? total : 1));
+  int src = 0, dst = 0;
+  for (int h = 0; h < nh; h++) {
+    int at = pre + hunk[h * 4], k = hunk[h * 4 + 1], m = hunk[h * 4 + 3];
+    int r = k < m ? k : m;
+    if (k == m) continue;
+    memcpy(&rows[dst], &E.row[src], sizeof(erow) * (at + r - src));
+    dst += at + r - src;
+    for (int i = r; i < k; i++) editorFreeRow(&E.row[at + i]);
+    for (int i = r; i < m; i++) {
+      int j = hunk[h * 4 + 2] + i;
+      editorRowSet(&rows[dst], dst, (char *)b->s[j], b->len[j]);
+      editorRowLayout(&E.pool, &rows[dst]);
+      dst++;
+    }
+    src = at + k;
+  }
+  memcpy(&rows[dst], &E.row[src], sizeof(erow) * (E.numrows - src));
+  free(E.row);
+  E.row = rows;
+  E.numrows = total;
+  for (int j = first; j < total; j++) E.row[j].idx = j;
+
+  // Highlight the new rows in order, then the row after each changed run,
+  // whose predecessor is different now; cascades take care of the rest.
+  shift = 0;
+  for (int h = 0; h < nh; h++) {
+    int at = pre + hunk[h * 4] + shift, k = hunk[h * 4 + 1], m = hunk[h * 4 + 3];
+    int r = k < m ? k : m;
+    shift += m - k;
+    if (k == m) continue;
+    for (int i = r; i < m; i++) {
+      editorUpdateSyntax(&E.row[at + i]);
+      editorTriIndexTouch(at + i);
+    }
+    if (at + m < E.numrows) editorUpdateSyntax(&E.row[at + m]);
+  }
+  E.dirty++;
+}
+
+// Function to make the buffer match the file on disk again. Lines are
+// compared first from both ends, which is all a local change needs, and
+// only the part in between is hashed and diffed. Just the differing rows
+// are replaced, as one undoable step; the rest keep their highlighting.
+// Returns the number of rows replaced, inserted or deleted, or -1.
+int editorReload() {
+  if (E.filename == NULL) return -1;
+  editorLoadFinish();
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  size_t size = st.st_size;
+  char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) return -1;
+
+  // A compressed file is compared with what it decompresses to.
+  size_t mapped = size;
+  char *plain = NULL;
+  int codec = data ? editorCodecDetect(data, size) : CODEC_NONE;
+  if (codec != CODEC_NONE && editorCodecSupported(codec)) {
+    plain = editorDecodeAll(codec, data, size, &size);
+    munmap(data, mapped);
+    if (plain == NULL) return -1;
+    data = plain;
+  }
+  E.codec = editorCodecSupported(codec) ? codec : CODEC_NONE;
+  const char *end = data + size;
+
+  // Skip the lines both versions start with...
+  int pre = 0;
+  const char *p = data;
+  while (pre < E.numrows && p < end) {
+    const char *next;
+    int len = editorLineSpan(p, end, &next);
+    if (!editorRowIs(&E.row[pre], p, len)) break;
+    pre++;
+    p = next;
+  }
 
-  // Read each line from the file and insert it as a row in the editor
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+  // ...and the ones they end with, without reaching back into that prefix.
+  int suf = E.numrows;
+  const char *q = end;
+  while (suf > pre && q > p) {
+    const char *ce = q;
+    if (ce[-1] == '\n') ce--;
+    const char *nl = ce > p ? memrchr(p, '\n', ce - p) : NULL;
+    const char *start = nl ? nl + 1 : p;
+    const char *next;
+    int len = editorLineSpan(start, q, &next);
+    if (!editorRowIs(&E.row[suf - 1], start, len)) break;
+    suf--;
+    q = start;
   }
 
-  free(line);
-  fclose(fp);
+  // Collect what is left on both sides.
+  struct reloadSide a, b;
+  a.n = suf - pre;
+  b.n = 0;
+  for (const char *t = p; t < q; b.n++) {
+    const char *nl = memchr(t, '\n', q - t);
+    t = nl ? nl + 1 : q;
+  }
+  struct reloadSide *sides[2] = { &a, &b };
+  for (int i = 0; i < 2; i++) {
+    struct reloadSide *sd = sides[i];
+    int n = sd->n ? sd->n : 1;
+    sd->s = malloc(sizeof(char *) * n);
+    sd->len = malloc(sizeof(int) * n);
+    sd->hash = malloc(sizeof(unsigned long long) * n);
+    sd->changed = calloc(n, 1);
+  }
+  for (int i = 0; i < a.n; i++) {
+    a.s[i] = E.row[pre + i].chars;
+    a.len[i] = E.row[pre + i].size;
+    a.hash[i] = editorLineHash(a.s[i], a.len[i]);
+  }
+  const char *t = p;
+  for (int j = 0; j < b.n; j++) {
+    b.s[j] = t;
+    b.len[j] = editorLineSpan(t, q, &t);
+    b.hash[j] = editorLineHash(b.s[j], b.len[j]);
+  }
+  editorReloadDiff(&a, &b);
+
+  // Gather the hunks first: replacing rows invalidates the pointers in a.
+  int nh = 0;
+  int *hunk = malloc(sizeof(int) * 4 * (a.n + b.n + 1));
+  int i = 0, j = 0;
+  while (i < a.n || j < b.n) {
+    if ((i < a.n && a.changed[i]) || (j < b.n && b.changed[j])) {
+      int i0 = i, j0 = j;
+      while (i < a.n && a.changed[i]) i++;
+      while (j < b.n && b.changed[j]) j++;
+      hunk[nh * 4] = i0;
+      hunk[nh * 4 + 1] = i - i0;
+      hunk[nh * 4 + 2] = j0;
+      hunk[nh * 4 + 3] = j - j0;
+      nh++;
+    } else {
+      i++;
+      j++;
+    }
+  }
+
+  int changed = 0;
+  editorUndoBeginGroup();
+  editorReloadApply(hunk, nh, pre, &b);
+  editorUndoEndGroup();
+  for (int h = 0; h < nh; h++)
+    changed += hunk[h * 4 + 1] > hunk[h * 4 + 3] ? hunk[h * 4 + 1] : hunk[h * 4 + 3];
+
+  for (int k = 0; k < 2; k++) {
+    free(sides[k]->s);
+    free(sides[k]->len);
+    free(sides[k]->hash);
+    free(sides[k]->changed);
+  }
+  free(hunk);
+  if (plain) free(plain);
+  else if (data) munmap(data, mapped);
+
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
   E.dirty = 0;
+  E.damaged = 0;
+  editorJournalStart(0);
+  editorDiskSync();
+  return changed;
 }
 
-// Function to save the current editor content to a file
-void editorSave() {
-  if (E.filename == NULL) {
-    // If there is no filename, prompt the user for a new one
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Function to reload on request and say how much changed.
+void editorReloadCommand() {
+  int changed = editorReload();
+  if (changed == -1) editorSetStatusMessage("Can't reload: %s", strerror(errno));
+  else editorSetStatusMessage("Reloaded from disk, %d lines changed", changed);
+}
+
+// Function to look for changes made to the file by other programs while
+// idle. A clean buffer is reloaded straight away; otherwise the user is
+// told once. Follow mode watches the file itself.
+void editorDiskTick() {
+  if (E.follow.fd != -1 || E.load.data || E.raw.mode) return;
+  if (editorNowMs() - E.disk.checked < KILO_DISK_CHECK_MS) return;
+  E.disk.checked = editorNowMs();
+  if (!editorDiskChanged()) return;
+
+  if (!E.dirty) {
+    editorReloadCommand();
+  } else if (!E.disk.warned) {
+    editorSetStatusMessage("%.20s changed on disk; ^O reloads it (^Z undoes)",
+                           E.filename);
+    E.disk.warned = 1;
+  } else {
+    return;
+  }
+  if (!E.batch) editorRefreshScreen();
+}
+
+/*** buffers ***/
+
+// Function to carry the terminal-wide parts of the editor state over from
+// another buffer into E.
+void editorBufferGlobals(struct editorConfig *from) {
+  E.screenrows = from->screenrows;
+  E.screencols = from->screencols;
+  memcpy(E.statusmsg, from->statusmsg, sizeof(E.statusmsg));
+  E.statusmsg_time = from->statusmsg_time;
+  E.orig_termios = from->orig_termios;
+  E.batch = from->batch;
+  E.wrap = from->wrap;
+}
+
+// Function to write the current buffer back to its slot before E is
+// given to another buffer; the list is created on first use.
+void editorBufferPark() {
+  if (B.len == 0) {
+    B.buf = realloc(B.buf, sizeof(struct editorConfig));
+    B.len = 1;
+    B.cur = 0;
+  }
+  editorJournalFlush(1);
+  editorFindEnd();
+  E.used = ++B.clock;
+  B.buf[B.cur] = E;
+}
+
+// Function to drop the render text, highlighting and cursor maps of a
+// background buffer. Its text is copied into a fresh, tightly packed pool
+// and the old pool's chunks go back to the shared spare list; the rest is
+// rebuilt row by row as the buffer is drawn again.
+void editorBufferCompact(struct editorConfig *b) {
+  struct rowPool pool;
+  memset(&pool, 0, sizeof(pool));
+  for (int j = 0; j < b->numrows; j++) {
+    erow *row = &b->row[j];
+    char *chars = editorPoolAlloc(&pool, row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+    row->render = row->tabs ? NULL : chars;
+    row->rsize = row->tabs ? 0 : row->size;
+    row->hl = NULL;
+    row->hl_runs = 0;
+    row->rxmap = NULL;
+    row->wrap = NULL;
+  }
+  editorRowPoolRelease(&b->pool);
+  b->pool = pool;
+  b->compact = 1;
+}
+
+// Function to keep the row memory of all buffers within KILO_MEM_BUDGET by
+// compacting the least recently used background buffers.
+void editorBufferBudget() {
+  size_t total = E.pool.bytes;
+  for (int i = 0; i < B.len; i++)
+    if (i != B.cur) total += B.buf[i].pool.bytes;
+
+  while (total > KILO_MEM_BUDGET) {
+    int lru = -1;
+    for (int i = 0; i < B.len; i++) {
+      if (i == B.cur || B.buf[i].compact) continue;
+      if (lru == -1 || B.buf[i].used < B.buf[lru].used) lru = i;
     }
-    // Select syntax highlighting based on the new filename's extension
-    editorSelectSyntaxHighlight();
+    if (lru == -1) return;
+    total -= B.buf[lru].pool.bytes;
+    editorBufferCompact(&B.buf[lru]);
+    total += B.buf[lru].pool.bytes;
   }
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  // Open the file for writing
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+// Function to put another open buffer in E. Only the editor state itself
+// is swapped, so this takes the same time for any file size.
+void editorBufferSwap(int to) {
+  if (to < 0 || to >= B.len || to == B.cur) return;
+  E.used = ++B.clock;
+  B.buf[B.cur] = E;
+  int from = B.cur;
+  E = B.buf[to];
+  editorBufferGlobals(&B.buf[from]);
+  B.cur = to;
+}
+
+// Function to make another open buffer the one being edited.
+void editorBufferSwitch(int to) {
+  if (to < 0 || to >= B.len || to == B.cur) return;
+  // The idle loop only flushes the journal of the buffer in E.
+  editorJournalFlush(1);
+  editorFindEnd();
+  editorBufferSwap(to);
+  // Rows dropped while in the background come back as they are drawn.
+  E.compact = 0;
+  E.disk.checked = 0;
+  editorBufferBudget();
+}
+
+// Function to reset E to an empty buffer, keeping the terminal state.
+void editorBufferReset() {
+  struct editorConfig keep = E;
+  initEditor();
+  editorBufferGlobals(&keep);
+}
+
+// Function to open a file in a buffer of its own, or switch to it if it is
+// open already. Returns -1 if the file can't be read.
+int editorBufferOpen(char *filename) {
+  if (E.filename && !strcmp(E.filename, filename)) return 0;
+  for (int i = 0; i < B.len; i++) {
+    if (i != B.cur && B.buf[i].filename && !strcmp(B.buf[i].filename, filename)) {
+      editorBufferSwitch(i);
+      return 0;
     }
-    close(fd);
   }
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+  close(fd);
+
+  // An untouched empty buffer, as at startup, is simply reused.
+  if (E.filename || E.numrows || E.dirty) {
+    editorBufferPark();
+    B.buf = realloc(B.buf, sizeof(struct editorConfig) * (B.len + 1));
+    B.cur = B.len++;
+    editorBufferReset();
+  }
+  editorOpen(filename);
+  editorBufferBudget();
+  return 0;
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// Function to release everything the current buffer holds.
+void editorBufferFree() {
+  editorFindDrop();
+  editorLoadCancel();
+  editorRawClose();
+  if (E.follow.fd != -1) close(E.follow.fd);
+  free(E.follow.name);
+  editorJournalClose(0);
+  free(E.journal.buf);
+  editorFreeAllRows();
+  free(E.undo.undo.buf);
+  free(E.undo.redo.buf);
+  free(E.filename);
+}
+
+// Function to close the current buffer and show the one before it (or
+// after it, for the first). The last buffer closed leaves an empty one.
+void editorBufferClose() {
+  editorBufferFree();
+  if (B.len <= 1) {
+    editorBufferReset();
+    B.len = 0;
+    return;
+  }
+  struct editorConfig keep = E;
+  int closed = B.cur;
+  memmove(&B.buf[B.cur], &B.buf[B.cur + 1], sizeof(struct editorConfig) * (B.len - B.cur - 1));
+  B.len--;
+  if (B.cur > 0) B.cur--;
+  E = B.buf[B.cur];
+  editorBufferGlobals(&keep);
+  E.compact = 0;
+  E.disk.checked = 0;
+
+  // Other panes showing the closed buffer show this one from the top.
+  for (int i = 0; i < V.len; i++) {
+    struct editorView *v = &V.v[i];
+    if (v->buf == closed) {
+      v->buf = B.cur;
+      v->cx = v->cy = v->rowoff = v->coloff = 0;
+    } else if (v->buf > closed) {
+      v->buf--;
+    }
+  }
+}
+
+// Function to count the open buffers with unsaved changes.
+int editorBufferDirty() {
+  int n = E.dirty != 0;
+  for (int i = 0; i < B.len; i++)
+    if (i != B.cur && B.buf[i].dirty) n++;
+  return n;
+}
+
+// Function to close the journals of all buffers before exiting.
+void editorBufferQuit() {
+  for (int i = 0; i < B.len; i++) {
+    if (i == B.cur) continue;
+    struct editorConfig keep = E;
+    E = B.buf[i];
+    editorJournalClose(0);
+    B.buf[i] = E;
+    E = keep;
+  }
+  editorJournalClose(0);
+}
+
+// Function to say which buffer is shown after switching.
+void editorBufferStatus() {
+  editorSetStatusMessage("Buffer %d/%d: %.40s | ^E open ^N/^B switch ^W close",
+                         B.cur + 1, B.len ? B.len : 1,
+                         E.filename ? E.filename : "[No Name]");
+}
+
+// Function to ask for a file and open it in a new buffer.
+void editorBufferOpenCommand() {
+  char *name = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (name == NULL) return;
+  if (editorBufferOpen(name) == -1) editorSetStatusMessage("Can't open %.40s: %s", name, strerror(errno));
+  else editorBufferStatus();
+  free(name);
 }
 
+// Function to close the current buffer, asking first if it has unsaved changes.
+void editorBufferCloseCommand() {
+  if (E.dirty) {
+    editorSetStatusMessage("%.20s has unsaved changes. Close it anyway? (y/n)",
+                           E.filename ? E.filename : "[No Name]");
+    editorRefreshScreen();
+    if (editorReadKey() != 'y') {
+      editorSetStatusMessage("");
+      return;
+    }
+  }
+  editorBufferClose();
+  editorBufferStatus();
+}
 
 /*** find ***/
 
-// Function to handle find operations initiated by user input
-void editorFindCallback(char *query, int key) {
-  // Static variables to remember the last match and search direction
-  static int last_match = -1;
-  static int direction = 1;
+// Function to forget the search without touching the rows, for when the
+// row it highlighted has been replaced.
+void editorFindDrop() {
+  free(S.saved_hl);
+  S.saved_hl = NULL;
+  S.last_match = -1;
+  S.direction = 1;
+}
+
+// Function to put back the highlighting the last match replaced. A row
+// that changed size since was edited, and its highlighting redone, so the
+// saved copy no longer fits and is just dropped.
+void editorFindRestore() {
+  if (S.saved_hl == NULL) return;
+  if (S.saved_hl_line < E.numrows) {
+    // The row may have been compacted in the meantime.
+    erow *row = &E.row[S.saved_hl_line];
+    editorRowEnsure(row);
+    if (row->rsize == S.saved_hl_len) editorRowHlStore(&E.pool, row, S.saved_hl);
+  }
+  free(S.saved_hl);
+  S.saved_hl = NULL;
+}
 
-  // Static variables to remember and restore the syntax highlighting of the matched line
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+// Function to end the search, giving the matched row its highlighting
+// back. The state belongs to the buffer in E, so this is done before
+// another buffer takes its place.
+void editorFindEnd() {
+  editorFindRestore();
+  editorFindDrop();
+}
 
+// Function to handle find operations initiated by user input
+void editorFindCallback(char *query, int key) {
   // If there is saved syntax highlighting, restore it and free the memory
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  editorFindRestore();
 
   // Handle special keys: Enter (Return) or Escape (ESC)
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+    S.last_match = -1;
+    S.direction = 1;
     return;
   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
+    S.direction = 1;
   } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+    S.direction = -1;
   } else {
-    last_match = -1;
-    direction = 1;
+    S.last_match = -1;
+    S.direction = 1;
   }
 
   // If there's no last match, set the search direction to forward (1)
-  if (last_match == -1) direction = 1;
-  int current = last_match;
+  if (S.last_match == -1) S.direction = 1;
+  int direction = S.direction;
+  // Searches wrap around, so they need the whole file.
+  editorLoadFinish();
+  int current = S.last_match;
+
+  // With a trigram index only the candidate rows need to be checked.
+  int *cand = NULL;
+  int ncand = editorTriIndexCandidates(query, &cand);
+  int pos = 0;
+  if (ncand > 0) {
+    pos = editorLowerBound(cand, ncand, S.last_match + (direction == 1));
+    if (direction == 1) pos--;
+  }
+
+  int total = (ncand >= 0) ? ncand : E.numrows;
   int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
+  for (i = 0; i < total; i++) {
+    if (ncand >= 0) {
+      pos += direction;
+      if (pos == -1) pos = ncand - 1;
+      else if (pos == ncand) pos = 0;
+      current = cand[pos];
+    } else {
+      current += direction;
+      if (current == -1) current = E.numrows - 1;
+      else if (current == E.numrows) current = 0;
+    }
 
     erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
+    char *match = strstr(editorRowRender(row), query);
     if (match) {
+      // Highlighting may move the row, so keep the match as a column.
+      int at = match - row->render;
+      editorRowEnsure(row);
       // Update the last match and cursor position
-      last_match = current;
+      S.last_match = current;
       E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
+      E.cx = editorRowRxToCx(row, editorRowRenderCol(row, at));
       E.rowoff = E.numrows;
 
       // Save the current line's syntax highlighting and highlight the match
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      S.saved_hl_line = current;
+      S.saved_hl_len = row->rsize;
+      S.saved_hl = malloc(row->rsize);
+      editorRowHlSlice(row, 0, row->rsize, S.saved_hl);
+      unsigned char *hl = editorHlScratch(row->rsize);
+      memcpy(hl, S.saved_hl, row->rsize);
+      memset(&hl[at], HL_MATCH, strlen(query));
+      editorRowHlStore(&E.pool, row, hl);
+      break;
+    }
+  }
+}
+
+// Function to initiate a find operation and handle user input for search queries
+void editorFind() {
+  // Save current cursor and display settings
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  // Prompt the user for a search query and invoke the callback function
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+  // Handle the result of the search query prompt
+  if (query) {
+    free(query);
+  } else {
+    // If the user canceled the search, restore previous cursor and display settings
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** goto ***/
+
+// Function to move the cursor to a 1-based line and column, clamped to the file.
+void editorGotoLine(int row, int col) {
+  editorLoadUntil(row - 1);
+  E.cy = row - 1;
+  if (E.cy < 0) E.cy = 0;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  E.cx = col - 1;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx < 0) E.cx = 0;
+  if (E.cx > rowlen) E.cx = rowlen;
+}
+
+// Function to move the cursor to a byte offset in the file.
+void editorGotoOffset(long long off) {
+  long long start;
+  if (off < 0) off = 0;
+  while (E.load.data && editorLineOffset(E.numrows) <= off) editorLoadUntil(E.numrows);
+  E.cy = editorLineAtOffset(off, &start);
+  E.cx = 0;
+  if (E.cy < E.numrows) {
+    E.cx = off - start;
+    if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  }
+}
+
+// Function to prompt for a line (LINE[:COL]) or byte offset (bOFFSET) and jump to it.
+void editorGoto() {
+  char *where = editorPrompt("Go to: %s (LINE[:COL] or bBYTE, ESC to cancel)", NULL);
+  if (where == NULL) return;
+
+  if (where[0] == 'b' || where[0] == 'B') {
+    editorGotoOffset(atoll(&where[1]));
+  } else {
+    int row = 1, col = 1;
+    sscanf(where, "%d:%d", &row, &col);
+    editorGotoLine(row, col);
+  }
+  free(where);
+}
+
+/*** replace ***/
+
+// Function to replace up to max occurrences of query in a row, starting at
+// offset 'from', in a single pass; the row is rebuilt once. max < 0 means all.
+int editorRowReplace(erow *row, int from, char *query, char *with, int max) {
+  int qlen = strlen(query);
+  int wlen = strlen(with);
+  // An empty query would match at the same offset forever.
+  if (qlen == 0) return 0;
+
+  // Count the matches first so the new buffer is allocated exactly once.
+  int n = 0;
+  char *p = &row->chars[from];
+  char *end = &row->chars[row->size];
+  char *m;
+  while (n != max && (m = memmem(p, end - p, query, qlen)) != NULL) {
+    n++;
+    p = m + qlen;
+  }
+  if (n == 0) return 0;
+
+  int newsize = row->size + n * (wlen - qlen);
+  char *buf = editorRowAlloc(newsize + 1);
+  char *dst = buf;
+  char *src = row->chars;
+  p = &row->chars[from];
+  for (int k = 0; k < n; k++) {
+    m = memmem(p, end - p, query, qlen);
+    memcpy(dst, src, m - src);
+    dst += m - src;
+    // Positions are recorded as if the matches were replaced one by one.
+    editorUndoRecord(row->idx, dst - buf, query, qlen, with, wlen);
+    memcpy(dst, with, wlen);
+    dst += wlen;
+    src = p = m + qlen;
+  }
+  memcpy(dst, src, end - src);
+  buf[newsize] = '\0';
+
+  editorRowFree(row->chars);
+  row->chars = buf;
+  row->size = newsize;
+  row->tabs += n * (editorCountTabs(with, wlen) - editorCountTabs(query, qlen));
+  if (!editorIsAscii(with, wlen)) row->utf8 = 1;
+  editorUpdateRow(row);
+  E.dirty++;
+  return n;
+}
+
+// Function to replace every occurrence from (at_x, at_y) to the end of the file.
+int editorReplaceAll(int at_y, int at_x, char *query, char *with) {
+  int replaced = 0;
+  if (*query == '\0') return 0;
+  editorLoadFinish();
+  if (at_y >= E.numrows) return 0;
+  replaced += editorRowReplace(&E.row[at_y], at_x, query, with, -1);
+
+  // The trigram index works on rendered text, so it can't vouch for tabs.
+  int *cand = NULL;
+  int ncand = strchr(query, '\t') ? -1 : editorTriIndexCandidates(query, &cand);
+  if (ncand >= 0) {
+    for (int i = editorLowerBound(cand, ncand, at_y + 1); i < ncand; i++)
+      replaced += editorRowReplace(&E.row[cand[i]], 0, query, with, -1);
+  } else {
+    for (int y = at_y + 1; y < E.numrows; y++)
+      replaced += editorRowReplace(&E.row[y], 0, query, with, -1);
+  }
+  return replaced;
+}
+
+// Function to step through matches from the cursor and replace them on request
+void editorReplace() {
+  // Replacing goes to the end of the file, so load all of it before the
+  // rows are held across prompts.
+  editorLoadFinish();
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  // An empty replacement deletes the matches.
+  char *with = editorPromptText("Replace with: %s (ESC to cancel)", NULL, 1);
+  if (with == NULL) {
+    free(query);
+    return;
+  }
+
+  int qlen = strlen(query);
+  int wlen = strlen(with);
+  int replaced = 0;
+  int x = E.cx;
+  int y = E.cy;
+
+  // The whole replace session is undone in one step.
+  editorUndoBeginGroup();
+
+  while (y < E.numrows) {
+    erow *row = &E.row[y];
+    char *m = (x <= row->size) ?
+      memmem(&row->chars[x], row->size - x, query, qlen) : NULL;
+    if (m == NULL) {
+      y++;
+      x = 0;
+      continue;
+    }
+
+    // Show the match and ask what to do with it.
+    E.cy = y;
+    E.cx = m - row->chars;
+    editorSetStatusMessage("Replace? (y)es (n)o (a)ll remaining (ESC) - %d replaced",
+                           replaced);
+    editorRefreshScreen();
+    int c = editorReadKey();
+
+    // The rows may have moved while the prompt waited, so look again.
+    if (c == 'y') {
+      replaced += editorRowReplace(&E.row[y], E.cx, query, with, 1);
+      x = E.cx + wlen;
+    } else if (c == 'n') {
+      x = E.cx + qlen;
+    } else if (c == 'a') {
+      replaced += editorReplaceAll(y, E.cx, query, with);
+      break;
+    } else if (c == '\x1b' || c == 'q') {
       break;
     }
   }
+
+  editorUndoEndGroup();
+
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  editorSetStatusMessage("Replaced %d occurrence%s%s", replaced,
+                         replaced == 1 ? "" : "s",
+                         editorUndoLost() ? "; too many to undo" : "");
+  free(query);
+  free(with);
+}
+
+
+/*** windows ***/
+
+// Function to set up the first pane, covering the whole screen.
+void editorViewInit() {
+  V.rows = E.screenrows + 1;
+  V.cols = E.screencols;
+  V.v = calloc(1, sizeof(struct editorView));
+  V.len = 1;
+  V.cur = 0;
+  struct editorView *v = &V.v[0];
+  v->buf = B.cur;
+  v->rows = E.screenrows;
+  v->cols = E.screencols;
+  v->wrap = E.wrap;
+  v->drawn = calloc(v->rows + 1, sizeof(unsigned long long));
+}
+
+// Function to give a pane a new place on the screen; all of it is redrawn.
+void editorViewPlace(struct editorView *v, int top, int left, int rows, int cols) {
+  v->top = top;
+  v->left = left;
+  v->rows = rows;
+  v->cols = cols;
+  free(v->drawn);
+  v->drawn = calloc(rows + 1, sizeof(unsigned long long));
+}
+
+// Function to forget what is on the screen, so the next frame redraws it all.
+void editorViewDamage() {
+  for (int i = 0; i < V.len; i++)
+    memset(V.v[i].drawn, 0, sizeof(unsigned long long) * (V.v[i].rows + 1));
+}
+
+// Function to remember the cursor and scroll position in E as pane v's.
+void editorViewStore(struct editorView *v) {
+  v->buf = B.cur;
+  v->cx = E.cx;
+  v->cy = E.cy;
+  v->rowoff = E.rowoff;
+  v->coloff = E.coloff;
+  v->subrow = E.subrow;
+  v->wrap = E.wrap;
+}
+
+// Function to put pane v's position and size into E, for the buffer that
+// is already there. Edits made through another pane may have shortened it.
+void editorViewLoad(struct editorView *v) {
+  if (E.raw.mode) {
+    // Raw views can't be edited, so the pane's position still holds.
+    E.cy = v->cy;
+    E.cx = v->cx;
+  } else {
+    E.cy = v->cy < E.numrows ? v->cy : E.numrows;
+    int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+    E.cx = v->cx < rowlen ? v->cx : rowlen;
+    if (E.cy < E.numrows) E.cx = editorRowCharStart(&E.row[E.cy], E.cx);
+  }
+  E.rowoff = v->rowoff;
+  E.coloff = v->coloff;
+  E.subrow = v->subrow;
+  E.wrap = v->wrap;
+  E.screenrows = v->rows;
+  E.screencols = v->cols;
 }
 
-// Function to initiate a find operation and handle user input for search queries
-void editorFind() {
-  // Save current cursor and display settings
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+// Function to move the keyboard focus to pane i.
+void editorViewFocus(int i) {
+  if (i == V.cur || i < 0 || i >= V.len) return;
+  editorViewStore(&V.v[V.cur]);
+  V.cur = i;
+  editorBufferSwitch(V.v[i].buf);
+  editorViewLoad(&V.v[i]);
+}
 
-  // Prompt the user for a search query and invoke the callback function
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+// Function to split the focused pane in two, one above the other or side
+// by side. The new pane shows the same place and takes the focus.
+void editorViewSplit(int side) {
+  if (V.len == 0) editorViewInit();
+  struct editorView *v = &V.v[V.cur];
+  // Stacked panes need a text row each besides their status bars; panes
+  // side by side need a column each besides the separator.
+  if (side ? v->cols < 3 : v->rows < 3) {
+    editorSetStatusMessage("No room to split this pane");
+    return;
+  }
+  editorViewStore(v);
+  V.v = realloc(V.v, sizeof(struct editorView) * (V.len + 1));
+  memmove(&V.v[V.cur + 2], &V.v[V.cur + 1], sizeof(struct editorView) * (V.len - V.cur - 1));
+  V.len++;
+  struct editorView *a = &V.v[V.cur], *b = &V.v[V.cur + 1];
+  *b = *a;
+  b->drawn = NULL;
+
+  if (side) {
+    int cols = (a->cols - 1) / 2;
+    editorViewPlace(b, a->top, a->left + cols + 1, a->rows, a->cols - cols - 1);
+    editorViewPlace(a, a->top, a->left, a->rows, cols);
+  } else {
+    int height = (a->rows + 1) / 2; // Text rows plus status bar
+    editorViewPlace(b, a->top + height, a->left, a->rows - height, a->cols);
+    editorViewPlace(a, a->top, a->left, height - 1, a->cols);
+  }
+  V.cur++;
+  editorViewLoad(b);
+  editorSetStatusMessage("Pane %d/%d | ^T/^V split ^A next pane ^K close pane", V.cur + 1, V.len);
+}
 
-  // Handle the result of the search query prompt
-  if (query) {
-    free(query);
+// Function to check whether pane o borders pane c on the given side (0
+// below, 1 above, 2 right, 3 left) without reaching past it. Returns how
+// much of c's edge it covers, separator or status bar included, or 0.
+int editorViewBorders(struct editorView *c, struct editorView *o, int side) {
+  if (side < 2) {
+    int edge = side == 0 ? o->top == c->top + c->rows + 1 : o->top + o->rows + 1 == c->top;
+    if (edge && o->left >= c->left && o->left + o->cols <= c->left + c->cols)
+      return o->cols + 1;
   } else {
-    // If the user canceled the search, restore previous cursor and display settings
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    int edge = side == 2 ? o->left == c->left + c->cols + 1 : o->left + o->cols + 1 == c->left;
+    if (edge && o->top >= c->top && o->top + o->rows <= c->top + c->rows)
+      return o->rows + 1;
   }
+  return 0;
 }
 
+// Function to close the focused pane. The panes along one of its sides
+// grow to take its place; splits always leave one side that fits exactly.
+void editorViewClose() {
+  if (V.len < 2) {
+    editorSetStatusMessage("This is the only pane");
+    return;
+  }
+  struct editorView *c = &V.v[V.cur];
+  int side, first = -1;
+  for (side = 0; side < 4; side++) {
+    int cover = 0;
+    for (int i = 0; i < V.len; i++)
+      if (i != V.cur) cover += editorViewBorders(c, &V.v[i], side);
+    if (cover == (side < 2 ? c->cols : c->rows) + 1) break;
+  }
+  if (side == 4) return;
+
+  for (int i = 0; i < V.len; i++) {
+    struct editorView *o = &V.v[i];
+    if (i == V.cur || !editorViewBorders(c, o, side)) continue;
+    if (side == 0) editorViewPlace(o, c->top, o->left, o->rows + c->rows + 1, o->cols);
+    else if (side == 1) editorViewPlace(o, o->top, o->left, o->rows + c->rows + 1, o->cols);
+    else if (side == 2) editorViewPlace(o, o->top, c->left, o->rows, o->cols + c->cols + 1);
+    else editorViewPlace(o, o->top, o->left, o->rows, o->cols + c->cols + 1);
+    if (first == -1) first = i;
+  }
+
+  free(c->drawn);
+  memmove(c, c + 1, sizeof(struct editorView) * (V.len - V.cur - 1));
+  V.len--;
+  if (first > V.cur) first--;
+  V.cur = first;
+  editorBufferSwitch(V.v[first].buf);
+  editorViewLoad(&V.v[first]);
+}
 
 /*** append buffer ***/
 
@@ -800,6 +4919,64 @@ void abFree(struct abuf *ab) {
 
 /*** output ***/
 
+// Function to move a visual line position (*row, *sub) one line down
+// (dir 1) or up (-1) while wrapping. Rows past the end are one line each.
+// Returns 0 if there is no line to move to.
+int editorWrapStep(int *row, int *sub, int dir) {
+  if (dir > 0) {
+    if (*row >= E.numrows) return 0;
+    if (*sub + 1 < editorRowLines(&E.row[*row], E.screencols)) {
+      (*sub)++;
+    } else {
+      (*row)++;
+      *sub = 0;
+    }
+  } else if (*sub > 0) {
+    (*sub)--;
+  } else {
+    if (*row == 0) return 0;
+    (*row)--;
+    *sub = *row < E.numrows ? editorRowLines(&E.row[*row], E.screencols) - 1 : 0;
+  }
+  return 1;
+}
+
+// Function to find the visual line the cursor is on while wrapping.
+int editorWrapCursorLine() {
+  if (E.cy >= E.numrows) return 0;
+  return editorRowLineOf(&E.row[E.cy], E.screencols, E.rx);
+}
+
+// Function to scroll by visual lines while wrapping. Only lines between
+// the top of the screen and the cursor are laid out, so this costs
+// O(screen rows) wherever the cursor is.
+void editorScrollWrap() {
+  E.coloff = 0;
+  int line = editorWrapCursorLine();
+  // Edits or a narrower pane can leave the top row with fewer lines.
+  if (E.rowoff < E.numrows && E.subrow >= editorRowLines(&E.row[E.rowoff], E.screencols))
+    E.subrow = 0;
+
+  if (E.cy < E.rowoff || (E.cy == E.rowoff && line < E.subrow)) {
+    E.rowoff = E.cy;
+    E.subrow = line;
+    return;
+  }
+  int row = E.rowoff, sub = E.subrow, y = 0;
+  while (y < E.screenrows && (row < E.cy || (row == E.cy && sub < line))) {
+    editorWrapStep(&row, &sub, 1);
+    y++;
+  }
+  if (y < E.screenrows) return;
+
+  // The cursor is below the screen: show its line at the bottom.
+  row = E.cy;
+  sub = line;
+  for (y = 1; y < E.screenrows && editorWrapStep(&row, &sub, -1); y++);
+  E.rowoff = row;
+  E.subrow = sub;
+}
+
 // Function to handle scrolling and update the display position
 void editorScroll() {
   // Initialize the rendered cursor position (rx) to 0
@@ -808,6 +4985,18 @@ void editorScroll() {
   if (E.cy < E.numrows) {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
+  // The hex view shows byte cx at a fixed column of its line.
+  if (E.raw.mode == RAW_HEX)
+    E.rx = E.raw.digits + 2 + E.cx * 3 + (E.cx >= KILO_HEX_BYTES / 2);
+  else if (E.raw.mode == RAW_LINES)
+    E.rx = E.cx;
+
+  if (E.wrap && !E.raw.mode) {
+    // Visual lines never outnumber rows, so this is enough to fill the screen.
+    if (!In.busy) editorLoadUntil(E.rowoff + E.screenrows);
+    editorScrollWrap();
+    return;
+  }
 
   // Scroll the display vertically based on the cursor position
   if (E.cy < E.rowoff) {
@@ -816,141 +5005,376 @@ void editorScroll() {
   if (E.cy >= E.rowoff + E.screenrows) {
     E.rowoff = E.cy - E.screenrows + 1;
   }
+  // Only wait for the part of a loading file that is about to be shown.
+  // Prompts redraw while their command holds rows, so they show what
+  // has loaded and the rest follows once the command is done.
+  if (!In.busy) editorLoadUntil(E.rowoff + E.screenrows);
 
   // Scroll the display horizontally based on the cursor position
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
-  if (E.rx >= E.coloff + E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
+  // All of a wide character under the cursor should be on screen.
+  int last = E.rx;
+  if (E.cy < E.numrows && E.row[E.cy].utf8 && E.cx < E.row[E.cy].size &&
+      E.row[E.cy].chars[E.cx] != '\t')
+    last = editorRowAdvance(&E.row[E.cy], E.cx, E.rx) - 1;
+  if (last < E.rx) last = E.rx;
+  if (last >= E.coloff + E.screencols) {
+    E.coloff = last - E.screencols + 1;
+  }
+}
+
+// Function to hash one finished screen line, for damage tracking.
+unsigned long long editorLineHashBytes(const char *s, int len) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Function to end a pane line of w columns and queue it for the screen at
+// row y of pane v, unless the same bytes are there already.
+void editorDrawLine(struct abuf *ab, struct abuf *line, struct editorView *v, int y, int w) {
+  // Blank out the rest of the pane; a pane ending at the screen edge can
+  // simply clear the line.
+  if (v->left + v->cols >= V.cols) {
+    abAppend(line, "\x1b[K", 3);
+  } else {
+    char buf[16];
+    if (w < v->cols) abAppend(line, buf, snprintf(buf, sizeof(buf), "\x1b[%dX", v->cols - w));
+    // The pane to the right starts after a separator column.
+    abAppend(line, "\x1b[m", 3);
+    abAppend(line, buf, snprintf(buf, sizeof(buf), "\x1b[%dG|", v->left + v->cols + 1));
+  }
+
+  unsigned long long h = editorLineHashBytes(line->b, line->len);
+  if (v->drawn[y] != h) {
+    char buf[32];
+    abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + y + 1, v->left + 1));
+    abAppend(ab, line->b, line->len);
+    v->drawn[y] = h;
+  }
+  line->len = 0;
+}
+
+// Function to draw the lines of a raw view into pane v. Each is made from
+// the mapping as it is drawn, and only its visible columns are looked at.
+void editorRawDrawRows(struct abuf *ab, struct editorView *v) {
+  struct abuf line = ABUF_INIT;
+  char hex[4 * KILO_HEX_BYTES + 24];
+  for (int y = 0; y < v->rows; y++) {
+    int filerow = E.rowoff + y, w = 0;
+    if (!editorRawHas(filerow)) {
+      abAppend(&line, "~", 1);
+      w = 1;
+    } else {
+      size_t start, end;
+      editorRawSpan(filerow, &start, &end);
+      const unsigned char *p = (const unsigned char *)E.raw.data + start;
+      size_t len = end - start;
+      if (E.raw.mode == RAW_HEX) {
+        // Offset, the bytes in two groups, then the bytes as text.
+        int n = snprintf(hex, sizeof(hex), "%0*zx  ", E.raw.digits, start);
+        for (size_t k = 0; k < KILO_HEX_BYTES; k++) {
+          if (k < len) n += snprintf(hex + n, sizeof(hex) - n, "%02x ", p[k]);
+          else n += snprintf(hex + n, sizeof(hex) - n, "   ");
+          if (k == KILO_HEX_BYTES / 2 - 1) hex[n++] = ' ';
+        }
+        hex[n++] = '|';
+        for (size_t k = 0; k < len; k++) hex[n++] = p[k] >= ' ' && p[k] < 0x7f ? p[k] : '.';
+        hex[n++] = '|';
+        p = (const unsigned char *)hex;
+        len = n;
+      }
+      for (size_t j = E.coloff; j < len && w < v->cols; j++, w++) {
+        char c = p[j];
+        if (p[j] >= ' ' && p[j] < 0x7f) {
+          abAppend(&line, &c, 1);
+        } else {
+          char sym = p[j] <= 26 ? '@' + p[j] : '?';
+          abAppend(&line, "\x1b[7m", 4);
+          abAppend(&line, &sym, 1);
+          abAppend(&line, "\x1b[m", 3);
+        }
+      }
+    }
+    editorDrawLine(ab, &line, v, y, w);
   }
+  abFree(&line);
 }
 
-// Function to draw the visible rows of text on the screen
-void editorDrawRows(struct abuf *ab) {
+// Function to draw the visible rows of the buffer in E into pane v.
+void editorDrawRows(struct abuf *ab, struct editorView *v) {
+  if (E.raw.mode) {
+    editorRawDrawRows(ab, v);
+    return;
+  }
+  struct abuf line = ABUF_INIT;
   int y;
-  for (y = 0; y < E.screenrows; y++) {
+  int wraprow = E.rowoff, sub = E.subrow;
+  for (y = 0; y < v->rows; y++) {
     int filerow = y + E.rowoff;
+    int start = E.coloff, end = -1;
+    if (E.wrap) {
+      // Wrapped rows take as many screen lines as they have visual lines.
+      filerow = wraprow;
+      if (filerow < E.numrows) editorRowLineSpan(&E.row[filerow], v->cols, sub, &start, &end);
+      if (!editorWrapStep(&wraprow, &sub, 1)) wraprow++;
+    }
+    int w = 0;
     if (filerow >= E.numrows) {
       // Display a welcome message or '~' for empty lines
-      if (E.numrows == 0 && y == E.screenrows / 3) {
+      if (E.numrows == 0 && V.len == 1 && y == v->rows / 3) {
         char welcome[80];
         int welcomelen = snprintf(welcome, sizeof(welcome),
           "Kilo editor -- version %s", KILO_VERSION);
-        if (welcomelen > E.screencols) welcomelen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
+        if (welcomelen > v->cols) welcomelen = v->cols;
+        int padding = (v->cols - welcomelen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          abAppend(&line, "~", 1);
           padding--;
+          w++;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        w += padding;
+        while (padding--) abAppend(&line, " ", 1);
+        abAppend(&line, welcome, welcomelen);
+        w += welcomelen;
         // Display the welcome message
       } else {
-        abAppend(ab, "~", 1);
+        abAppend(&line, "~", 1);
+        w = 1;
       }
     } else {
       // Display the content of the file with syntax highlighting
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      erow *row = &E.row[filerow];
+      editorRowEnsure(row);
+      if (end == -1 || end > start + v->cols) end = start + v->cols;
+      // Find the bytes of the columns [start, end). A wide character cut
+      // by the left edge leaves its second half blank.
+      int x = 0;
+      int from = editorRowSkip(row, 0, &x, start);
+      for (; w < x - start; w++) abAppend(&line, " ", 1);
+      int to = editorRowSkip(row, from, &x, end);
+      x = start + w;
+
+      int len = to - from;
+      char *c = &row->render[from];
+      unsigned char *hl = editorHlScratch(len);
+      editorRowHlSlice(row, from, len, hl);
       int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
+      int j, n;
+      for (j = 0; j < len; j += n) {
+        int cp = (unsigned char)c[j], cw = 1;
+        n = 1;
+        if (cp >= 0x80) {
+          n = editorUtf8Decode(&c[j], len - j, &cp);
+          cw = editorCodeWidth(cp);
+        }
+        // A wide character that doesn't fit is left for the next column.
+        if (x + cw > end) break;
+        x += cw;
+        w += cw;
+        if (cp < 0 || (cp < 0x80 && iscntrl(cp))) {
+          char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+          abAppend(&line, "\x1b[7m", 4);
+          abAppend(&line, &sym, 1);
+          abAppend(&line, "\x1b[m", 3);
           if (current_color != -1) {
             char buf[16];
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
+            abAppend(&line, buf, clen);
           }
         } else if (hl[j] == HL_NORMAL) {
           if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
+            abAppend(&line, "\x1b[39m", 5);
             current_color = -1;
           }
-          abAppend(ab, &c[j], 1);
+          abAppend(&line, &c[j], n);
         } else {
           int color = editorSyntaxToColor(hl[j]);
           if (color != current_color) {
             current_color = color;
             char buf[16];
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
+            abAppend(&line, buf, clen);
           }
-          abAppend(ab, &c[j], 1);
+          abAppend(&line, &c[j], n);
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+      abAppend(&line, "\x1b[39m", 5);
     }
 
-    // Clear the rest of the line and move to the next line
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    // Clear the rest of the pane line and hand it over if it changed
+    editorDrawLine(ab, &line, v, y, w);
   }
+  abFree(&line);
 }
-// Function to draw the status bar at the top of the screen
-void editorDrawStatusBar(struct abuf *ab) {
+// Function to draw the status bar under pane v
+void editorDrawStatusBar(struct abuf *ab, struct editorView *v) {
   // Display file information, such as filename, line count, and modification status
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  struct abuf line = ABUF_INIT;
+  abAppend(&line, "\x1b[7m", 4);
+  char status[80], rstatus[80], tag[32] = "";
+  if (B.len > 1) snprintf(tag, sizeof(tag), "[%d/%d] ", B.cur + 1, B.len);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", tag,
     E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-  if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
+  if (E.load.data) {
+    len = snprintf(status, sizeof(status), "%s%.20s - %d lines, loading %d%% %s", tag,
+      E.filename ? E.filename : "[No Name]", E.numrows,
+      (int)(E.load.pos * 100 / E.load.size), E.dirty ? "(modified)" : "");
+  }
+  int rlen;
+  if (E.raw.mode) {
+    // More lines may follow those the line view has found so far.
+    int more = E.raw.mode == RAW_LINES && E.raw.scanned < E.raw.size;
+    len = snprintf(status, sizeof(status), "%s%.20s - %d%s lines (read-only)", tag,
+      E.filename ? E.filename : "[No Name]", editorRawLines(), more ? "+" : "");
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld",
+      E.raw.mode == RAW_HEX ? "hex" : "lines", E.cy + 1, editorRawLines(),
+      editorRawOffset());
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | @%lld",
+      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows,
+      editorLineOffset(E.cy) + E.cx);
+  }
+  if (len > v->cols) len = v->cols;
+  abAppend(&line, status, len);
+  while (len < v->cols) {
+    if (v->cols - len == rlen) {
+      abAppend(&line, rstatus, rlen);
+      len += rlen;
       break;
     } else {
-      abAppend(ab, " ", 1);
+      abAppend(&line, " ", 1);
       len++;
     }
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  abAppend(&line, "\x1b[m", 3);
+  editorDrawLine(ab, &line, v, v->rows, len);
+  abFree(&line);
 }
 // Function to draw the message bar at the bottom of the screen
 void editorDrawMessageBar(struct abuf *ab) {
   // Display status messages (e.g., search results or error messages)
+  char pos[16];
+  abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H", V.rows + 1));
   abAppend(ab, "\x1b[K", 3);
+
+#ifdef KILO_PROFILE
+  // The profiler overlay replaces the message with the last frame's counters.
+  if (P.overlay) {
+    char prof[160];
+    struct profFrame *f = &P.last;
+    int plen = snprintf(prof, sizeof(prof),
+      "scroll %lldus draw %lldus hl %lldus/%lld rows write %lldus | %lld B %lld allocs",
+      f->ns[PROF_SCROLL] / 1000, f->ns[PROF_DRAW] / 1000,
+      f->ns[PROF_HIGHLIGHT] / 1000, f->rows_hl, f->ns[PROF_WRITE] / 1000,
+      f->bytes, f->allocs);
+    if (plen > V.cols) plen = V.cols;
+    abAppend(ab, prof, plen);
+    return;
+  }
+#endif
+
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) msglen = E.screencols;
+  if (msglen > V.cols) msglen = V.cols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
     abAppend(ab, E.statusmsg, msglen);
 }
+// Function to write a finished frame and, when replaying, measure how long
+// the keypress that caused it took to reach the screen.
+void editorFlushFrame(const char *buf, int len) {
+  PROF_BEGIN(PROF_WRITE);
+  write(In.outfd, buf, len);
+  PROF_END(PROF_WRITE);
+
+#ifdef KILO_PROFILE
+  // The counters so far belong to this frame; start over for the next one.
+  P.cur.bytes += len;
+  P.last = P.cur;
+  memset(&P.cur, 0, sizeof(P.cur));
+#endif
+
+  if (In.key_ns == 0) return;
+
+  if (In.nlat == In.latcap) {
+    In.latcap = In.latcap ? In.latcap * 2 : 1024;
+    In.lat = realloc(In.lat, sizeof(long long) * In.latcap);
+  }
+  In.lat[In.nlat++] = editorNowNs() - In.key_ns;
+  In.key_ns = 0;
+}
+
+// Function to draw a pane that doesn't have the focus. Its buffer is put
+// in E for the time being, so both panes of a buffer share its rows and
+// highlighting.
+void editorDrawView(struct abuf *ab, struct editorView *v) {
+  int focus = B.cur;
+  struct editorConfig keep = E;
+  editorBufferSwap(v->buf);
+  editorViewLoad(v);
+  editorScroll();
+  editorDrawRows(ab, v);
+  editorDrawStatusBar(ab, v);
+  editorViewStore(v);
+
+  if (B.cur == focus) {
+    E.cx = keep.cx;
+    E.cy = keep.cy;
+    E.rowoff = keep.rowoff;
+    E.coloff = keep.coloff;
+    E.subrow = keep.subrow;
+  } else {
+    editorBufferSwap(focus);
+  }
+  E.screenrows = keep.screenrows;
+  E.screencols = keep.screencols;
+  E.wrap = keep.wrap;
+}
+
 // Function to refresh the entire screen
 void editorRefreshScreen() {
+  if (V.len == 0) editorViewInit();
+  PROF_BEGIN(PROF_SCROLL);
   editorScroll();
+  PROF_END(PROF_SCROLL);
 
   struct abuf ab = ABUF_INIT;
 
-  // Hide the cursor, move to the top left corner, and start drawing
-
+  // Hide the cursor and start drawing
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
-  // Draw the visible rows, status bar, and message bar
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
+  // Draw every pane, then the message bar; unchanged lines are skipped
+  PROF_BEGIN(PROF_DRAW);
+  struct editorView *cur = &V.v[V.cur];
+  cur->buf = B.cur;
+  for (int i = 0; i < V.len; i++) {
+    if (i != V.cur) editorDrawView(&ab, &V.v[i]);
+  }
+  editorDrawRows(&ab, cur);
+  editorDrawStatusBar(&ab, cur);
+  PROF_END(PROF_DRAW);
   editorDrawMessageBar(&ab);
 
+  int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+  if (E.wrap && !E.raw.mode) {
+    // Count the visual lines down to the cursor; scrolling kept them on screen.
+    int line = editorWrapCursorLine(), row = E.rowoff, sub = E.subrow, end;
+    for (cy = 0; row < E.cy || (row == E.cy && sub < line); cy++)
+      editorWrapStep(&row, &sub, 1);
+    cx = E.rx;
+    if (E.cy < E.numrows) editorRowLineSpan(&E.row[E.cy], E.screencols, line, &cx, &end);
+    // The end of a full last line has no column of its own.
+    cx = E.rx - cx < E.screencols ? E.rx - cx : E.screencols - 1;
+  }
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cur->top + cy + 1, cur->left + cx + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorFlushFrame(ab.b, ab.len);
   abFree(&ab);
 }
 
@@ -966,6 +5390,12 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 // Function to display a user prompt and capture user input
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  return editorPromptText(prompt, callback, 0);
+}
+
+// Function to prompt for a line of input, which may be empty if allow_empty
+// is set. Returns NULL when the prompt is cancelled.
+char *editorPromptText(char *prompt, void (*callback)(char *, int), int allow_empty) {
   // Initialize buffer size and allocate memory for input buffer
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
@@ -992,12 +5422,12 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       return NULL;
     } else if (c == '\r') {
       // Handle enter key
-      if (buflen != 0) {
+      if (buflen != 0 || allow_empty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c < 256 && !iscntrl(c)) {
       // Handle printable characters
       if (buflen == bufsize - 1) {
         // If the buffer is full, reallocate it with double the size
@@ -1013,8 +5443,159 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+// Function to put the cursor at the start of visual line sub of a row.
+void editorWrapPlace(int row, int sub) {
+  E.cy = row;
+  E.cx = 0;
+  if (row >= E.numrows) return;
+  int start, end;
+  editorRowLineSpan(&E.row[row], E.screencols, sub, &start, &end);
+  E.cx = editorRowRxToCx(&E.row[row], start);
+}
+
+// Function to move the cursor one visual line up (dir -1) or down (1)
+// while wrapping, keeping its column within the line where possible.
+void editorWrapMove(int dir) {
+  int row = E.cy, sub = 0, col = 0, start, end;
+  if (row < E.numrows) {
+    int rx = editorRowCxToRx(&E.row[row], E.cx);
+    sub = editorRowLineOf(&E.row[row], E.screencols, rx);
+    editorRowLineSpan(&E.row[row], E.screencols, sub, &start, &end);
+    col = rx - start;
+  }
+  if (!editorWrapStep(&row, &sub, dir)) return;
+  editorWrapPlace(row, sub);
+  if (row >= E.numrows) return;
+
+  editorRowLineSpan(&E.row[row], E.screencols, sub, &start, &end);
+  int rx = start + col;
+  // The end of a line that wraps already belongs to the next one.
+  int last = end < editorRowWidth(&E.row[row]) ? end - 1 : end;
+  E.cx = editorRowRxToCx(&E.row[row], rx < last ? rx : last);
+}
+
+// Function to move the cursor of a raw view.
+void editorRawMove(int key) {
+  switch (key) {
+    case ARROW_LEFT:
+      if (E.cx > 0) {
+        E.cx--;
+      } else if (E.cy > 0) {
+        E.cy--;
+        E.cx = INT_MAX;
+      }
+      break;
+    case ARROW_RIGHT:
+      if (E.cx < editorRawLast(E.cy)) {
+        E.cx++;
+      } else if (editorRawHas(E.cy + 1)) {
+        E.cy++;
+        E.cx = 0;
+      }
+      break;
+    case ARROW_UP:
+      if (E.cy > 0) E.cy--;
+      break;
+    case ARROW_DOWN:
+      if (editorRawHas(E.cy + 1)) E.cy++;
+      break;
+    case PAGE_UP:
+      E.cy = E.cy > E.screenrows ? E.cy - E.screenrows : 0;
+      break;
+    case PAGE_DOWN:
+      for (int n = 0; n < E.screenrows && editorRawHas(E.cy + 1); n++) E.cy++;
+      break;
+    case HOME_KEY:
+      E.cx = 0;
+      break;
+    case END_KEY:
+      E.cx = INT_MAX;
+      break;
+  }
+  if (E.cx > editorRawLast(E.cy)) E.cx = editorRawLast(E.cy);
+  if (E.cx < 0) E.cx = 0;
+}
+
+// Function to map the file of a raw view again, after it changed on disk.
+void editorRawReload() {
+  int fd = open(E.filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    editorSetStatusMessage("Can't reload: %s", strerror(errno));
+    if (fd != -1) close(fd);
+    return;
+  }
+  char *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    editorSetStatusMessage("Can't reload: %s", strerror(errno));
+    return;
+  }
+  long long off = editorRawOffset();
+  int mode = E.raw.mode;
+  editorRawClose();
+  E.raw.mode = mode;
+  E.raw.data = data;
+  E.raw.mapped = st.st_size;
+  editorSetStatusMessage("Reloaded from disk");
+  editorRawFit();
+  editorRawGoto(off);
+}
+
+// Function to handle a keypress in a raw view. Returns 0 for the keys that
+// do the same in every buffer, such as quitting and working with panes.
+int editorRawKey(int c) {
+  switch (c) {
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case PAGE_UP:
+    case PAGE_DOWN:
+    case HOME_KEY:
+    case END_KEY:
+      editorRawMove(c);
+      return 1;
+
+    case CTRL_KEY('x'):
+      editorRawToggle();
+      return 1;
+
+    case CTRL_KEY('o'):
+      editorRawReload();
+      return 1;
+
+    case CTRL_KEY('g'): {
+      char *off = editorPrompt("Go to byte offset: %s (ESC to cancel)", NULL);
+      if (off) editorRawGoto(strtoll(off, NULL, 0));
+      free(off);
+      return 1;
+    }
+
+    case CTRL_KEY('q'):
+    case CTRL_KEY('e'):
+    case CTRL_KEY('n'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('w'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('v'):
+    case CTRL_KEY('a'):
+    case CTRL_KEY('k'):
+    case CTRL_KEY('l'):
+    case CTRL_KEY('p'):
+      return 0;
+
+    case '\x1b':
+      return 1;
+  }
+  editorSetStatusMessage("%.20s is open read-only (^X switches view)", E.filename);
+  return 1;
+}
+
 // Function to move the cursor based on arrow key presses
 void editorMoveCursor(int key) {
+  // Moving down needs the next row, if the file has one.
+  editorLoadUntil(E.cy + 1);
   // Get the current row
   erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
@@ -1023,7 +5604,7 @@ void editorMoveCursor(int key) {
     // Move cursor left
     // Handle boundary conditions
       if (E.cx != 0) {
-        E.cx--;
+        E.cx = editorRowPrevChar(row, E.cx);
       } else if (E.cy > 0) {
         E.cy--;
         E.cx = E.row[E.cy].size;
@@ -1033,7 +5614,7 @@ void editorMoveCursor(int key) {
       // Move cursor right
       // Handle boundary conditions
       if (row && E.cx < row->size) {
-        E.cx++;
+        E.cx = editorRowNextChar(row, E.cx);
       } else if (row && E.cx == row->size) {
         E.cy++;
         E.cx = 0;
@@ -1042,14 +5623,18 @@ void editorMoveCursor(int key) {
     case ARROW_UP:
     // Move cursor up
     // Handle boundary conditions
-      if (E.cy != 0) {
+      if (E.wrap) {
+        editorWrapMove(-1);
+      } else if (E.cy != 0) {
         E.cy--;
       }
       break;
     case ARROW_DOWN:
      // Move cursor down
     // Handle boundary conditions
-      if (E.cy < E.numrows) {
+      if (E.wrap) {
+        editorWrapMove(1);
+      } else if (E.cy < E.numrows) {
         E.cy++;
       }
       break;
@@ -1060,12 +5645,16 @@ void editorMoveCursor(int key) {
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // Don't land inside a multibyte character of the new row.
+  if (row) E.cx = editorRowCharStart(row, E.cx);
 }
 // Function to process user keypress events
 void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  // Binary and huge-line files only take keys that don't edit.
+  if (E.raw.mode && editorRawKey(c)) return;
 
   switch (c) {
     case '\r':
@@ -1073,12 +5662,21 @@ void editorProcessKeypress() {
       break;
 
     case CTRL_KEY('q'):
-      if (E.dirty && quit_times > 0) {
-        editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-          "Press Ctrl-Q %d more times to quit.", quit_times);
+      if (editorBufferDirty() && quit_times > 0) {
+        editorSetStatusMessage("WARNING!!! %d file(s) have unsaved changes. "
+          "Press Ctrl-Q %d more times to quit.", editorBufferDirty(), quit_times);
         quit_times--;
         return;
       }
+      // Quitting during a load drops the rest of the file.
+      editorLoadCancel();
+      // A replayed session ends here instead of exiting the process.
+      if (In.replay) {
+        In.done = 1;
+        return;
+      }
+      editorBufferQuit();
+      if (In.record) fclose(In.record);
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1101,6 +5699,67 @@ void editorProcessKeypress() {
       editorFind();
       break;
 
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
+    case CTRL_KEY('g'):
+      editorGoto();
+      break;
+
+    case CTRL_KEY('o'):
+      editorReloadCommand();
+      break;
+
+    case CTRL_KEY('e'):
+      editorBufferOpenCommand();
+      break;
+
+    case CTRL_KEY('n'):
+    case CTRL_KEY('b'):
+      if (B.len > 1) {
+        editorBufferSwitch((B.cur + (c == CTRL_KEY('n') ? 1 : B.len - 1)) % B.len);
+        editorBufferStatus();
+      }
+      break;
+
+    case CTRL_KEY('w'):
+      editorBufferCloseCommand();
+      break;
+
+    case CTRL_KEY('t'):
+    case CTRL_KEY('v'):
+      editorViewSplit(c == CTRL_KEY('v'));
+      break;
+
+    case CTRL_KEY('a'):
+      editorViewFocus((V.cur + 1) % V.len);
+      break;
+
+    case CTRL_KEY('k'):
+      editorViewClose();
+      break;
+
+    case CTRL_KEY('u'):
+      E.wrap = !E.wrap;
+      E.subrow = 0;
+      editorSetStatusMessage("Soft wrap %s (^U toggles)", E.wrap ? "on" : "off");
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
+#ifdef KILO_PROFILE
+    case CTRL_KEY('p'):
+      P.overlay = !P.overlay;
+      break;
+#endif
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1111,7 +5770,13 @@ void editorProcessKeypress() {
     case PAGE_UP:
     case PAGE_DOWN:
       {
-        if (c == PAGE_UP) {
+        if (E.wrap) {
+          // Start from the top or bottom visual line on the screen.
+          int row = E.rowoff, sub = E.subrow;
+          for (int y = 1; c == PAGE_DOWN && y < E.screenrows; y++)
+            if (!editorWrapStep(&row, &sub, 1)) break;
+          editorWrapPlace(row, sub);
+        } else if (c == PAGE_UP) {
           E.cy = E.rowoff;
         } else if (c == PAGE_DOWN) {
           E.cy = E.rowoff + E.screenrows - 1;
@@ -1132,6 +5797,9 @@ void editorProcessKeypress() {
       break;
 
     case CTRL_KEY('l'):
+      editorViewDamage();
+      break;
+
     case '\x1b':
       break;
 
@@ -1144,6 +5812,285 @@ void editorProcessKeypress() {
   quit_times = KILO_QUIT_TIMES;
 }
 
+/*** batch mode ***/
+
+// Struct to accumulate the timings of one script command.
+struct batchStat {
+  char name[16];            // Command name.
+  long long count;          // Number of times it ran.
+  long long ns;             // Total time spent in it.
+};
+
+// Function to expand \n, \t, \s and \\ escapes of a script argument in place.
+void editorBatchUnescape(char *s) {
+  char *d = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+      if (*s == 'n') *d++ = '\n';
+      else if (*s == 't') *d++ = '\t';
+      else if (*s == 's') *d++ = ' ';
+      else *d++ = *s;
+    } else {
+      *d++ = *s;
+    }
+  }
+  *d = '\0';
+}
+
+// Function to run one script command. Returns -1 for an unknown command.
+int editorBatchCommand(char *cmd, char *arg) {
+  int n = (arg && *arg) ? atoi(arg) : 1;
+
+  if (!strcmp(cmd, "goto")) {
+    int row = 1, col = 1;
+    if (arg) sscanf(arg, "%d %d", &row, &col);
+    editorGotoLine(row, col);
+  } else if (!strcmp(cmd, "gotobyte")) {
+    if (arg == NULL) return 0;
+    editorGotoOffset(atoll(arg));
+  } else if (!strcmp(cmd, "insert")) {
+    if (arg == NULL) return 0;
+    editorBatchUnescape(arg);
+    for (char *p = arg; *p; p++) {
+      if (*p == '\n') editorInsertNewline();
+      else editorInsertChar(*p);
+    }
+  } else if (!strcmp(cmd, "newline")) {
+    while (n--) editorInsertNewline();
+  } else if (!strcmp(cmd, "delete")) {
+    while (n--) editorDelChar();
+  } else if (!strcmp(cmd, "find") || !strcmp(cmd, "findnext")) {
+    if (arg == NULL) return 0;
+    editorBatchUnescape(arg);
+    editorFindCallback(arg, cmd[4] ? ARROW_DOWN : 0);
+  } else if (!strcmp(cmd, "replace")) {
+    char *with = arg ? strchr(arg, ' ') : NULL;
+    if (with == NULL) return 0;
+    *with++ = '\0';
+    editorBatchUnescape(arg);
+    editorBatchUnescape(with);
+    if (*arg == '\0') return 0;
+    editorUndoBeginGroup();
+    editorReplaceAll(0, 0, arg, with);
+    editorUndoEndGroup();
+  } else if (!strcmp(cmd, "reload")) {
+    if (editorReload() == -1) return -2;
+  } else if (!strcmp(cmd, "open")) {
+    if (arg == NULL || editorBufferOpen(arg) == -1) return -2;
+  } else if (!strcmp(cmd, "buffer")) {
+    editorBufferSwitch(n - 1);
+  } else if (!strcmp(cmd, "undo")) {
+    while (n--) editorUndo();
+  } else if (!strcmp(cmd, "redo")) {
+    while (n--) editorRedo();
+  } else if (!strcmp(cmd, "save")) {
+    // A compressed file read without its codec is never written back.
+    if ((arg == NULL || !*arg) && E.undecoded != CODEC_NONE) {
+      errno = ENOTSUP;
+      return -2;
+    }
+    if (editorWriteFileAtomic(arg && *arg ? arg : E.filename) == -1) return -2;
+    if (arg == NULL || !*arg) E.dirty = 0;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Function to run the editor headless: load a file, apply a command script
+// through the normal editor operations and write a timing report.
+// Usage: kilo --batch SCRIPT FILE [REPORT]
+int editorBatch(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: kilo --batch SCRIPT FILE [REPORT]\n");
+    return 2;
+  }
+  FILE *script = fopen(argv[0], "r");
+  if (!script) {
+    perror(argv[0]);
+    return 1;
+  }
+  FILE *report = argc >= 3 ? fopen(argv[2], "w") : stdout;
+  if (!report) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  initEditor();
+  E.batch = 1;
+  long long start = editorNowNs();
+  editorOpen(argv[1]);
+  long long load_ns = editorNowNs() - start;
+
+  struct batchStat stats[32];
+  int nstats = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  int lineno = 0;
+  int status = 0;
+
+  while ((linelen = getline(&line, &linecap, script)) != -1) {
+    lineno++;
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      line[--linelen] = '\0';
+    if (linelen == 0 || line[0] == '#') continue;
+
+    // "repeat N <command>" runs the command N times.
+    long long times = 1;
+    char *cmd = line;
+    if (!strncmp(cmd, "repeat ", 7)) {
+      times = strtoll(cmd + 7, &cmd, 10);
+      while (*cmd == ' ') cmd++;
+    }
+    char *arg = strchr(cmd, ' ');
+    if (arg) *arg++ = '\0';
+
+    // Commands unescape their argument, so each repetition gets a fresh copy.
+    char *argcopy = arg ? malloc(strlen(arg) + 1) : NULL;
+    long long ns = 0;
+    int rc = 0;
+    for (long long t = 0; t < times && rc == 0; t++) {
+      if (arg) strcpy(argcopy, arg);
+      long long t0 = editorNowNs();
+      rc = editorBatchCommand(cmd, argcopy);
+      ns += editorNowNs() - t0;
+    }
+    free(argcopy);
+
+    if (rc == -1) {
+      fprintf(stderr, "%s:%d: unknown command '%s'\n", argv[0], lineno, cmd);
+      status = 1;
+      break;
+    } else if (rc == -2) {
+      fprintf(stderr, "%s:%d: %s failed: %s\n", argv[0], lineno, cmd, strerror(errno));
+      status = 1;
+      break;
+    }
+
+    int j;
+    for (j = 0; j < nstats && strcmp(stats[j].name, cmd); j++);
+    if (j == nstats && nstats < (int)(sizeof(stats) / sizeof(stats[0]))) {
+      snprintf(stats[j].name, sizeof(stats[j].name), "%s", cmd);
+      stats[j].count = 0;
+      stats[j].ns = 0;
+      nstats++;
+    }
+    if (j < nstats) {
+      stats[j].count += times;
+      stats[j].ns += ns;
+    }
+  }
+  free(line);
+  fclose(script);
+  editorFindCallback("", '\r');
+
+  // Tab-separated so the report can be diffed and parsed by scripts.
+  long long total_ns = editorNowNs() - start;
+  fprintf(report, "file\t%s\nrows\t%d\nload_ms\t%.3f\n", argv[1], E.numrows,
+          load_ns / 1e6);
+  fprintf(report, "op\tcount\ttotal_ms\tavg_us\n");
+  for (int j = 0; j < nstats; j++) {
+    fprintf(report, "%s\t%lld\t%.3f\t%.3f\n", stats[j].name, stats[j].count,
+            stats[j].ns / 1e6, stats[j].count ? stats[j].ns / 1e3 / stats[j].count : 0);
+  }
+  fprintf(report, "total_ms\t%.3f\n", total_ns / 1e6);
+  if (report != stdout) fclose(report);
+
+  editorBufferQuit();
+  return status;
+}
+
+/*** record/replay ***/
+
+// Function to compare two latencies for qsort.
+int editorLatCmp(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Function to replay a recorded keystroke log against a file without a
+// terminal, and report keystroke-to-frame latencies. Frames are rendered in
+// full and written to /dev/null. Replaying a session that saved will save.
+// Keys are fed as fast as they are handled; of the recorded gaps only those
+// longer than the read timeout count, so a lone ESC stays one.
+// Usage: kilo --replay LOG FILE [REPORT]
+int editorReplay(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: kilo --replay LOG FILE [REPORT]\n");
+    return 2;
+  }
+  FILE *log = fopen(argv[0], "r");
+  if (!log) {
+    perror(argv[0]);
+    return 1;
+  }
+  FILE *report = argc >= 3 ? fopen(argv[2], "w") : stdout;
+  if (!report) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  // Each log line is "<microseconds since start> <byte>".
+  size_t cap = 4096;
+  In.replay = malloc(cap);
+  In.replay_us = malloc(sizeof(long long) * cap);
+  long long us;
+  int byte;
+  while (fscanf(log, "%lld %d", &us, &byte) == 2) {
+    if (In.replay_len == cap) {
+      cap *= 2;
+      In.replay = realloc(In.replay, cap);
+      In.replay_us = realloc(In.replay_us, sizeof(long long) * cap);
+    }
+    In.replay_us[In.replay_len] = us;
+    In.replay[In.replay_len++] = byte;
+  }
+  fclose(log);
+
+  // Headless like a script run, which also keeps the replay away from the
+  // file's journal; it may hold a crashed session's edits.
+  initEditor();
+  E.batch = 1;
+  In.outfd = open("/dev/null", O_WRONLY);
+  editorOpen(argv[1]);
+
+  long long start = editorNowNs();
+  while (In.replay_pos < In.replay_len && !In.done) {
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
+  editorRefreshScreen();
+  long long total_ns = editorNowNs() - start;
+
+  // Exact percentiles from the sorted samples, plus a log2 histogram.
+  qsort(In.lat, In.nlat, sizeof(long long), editorLatCmp);
+  size_t n = In.nlat;
+  fprintf(report, "keys\t%zu\nbytes\t%zu\ntotal_ms\t%.3f\n", n, In.replay_len,
+          total_ns / 1e6);
+  if (n) {
+    fprintf(report, "p50_us\t%.1f\np90_us\t%.1f\np99_us\t%.1f\nmax_us\t%.1f\n",
+            In.lat[n / 2] / 1e3, In.lat[n * 9 / 10] / 1e3,
+            In.lat[n * 99 / 100] / 1e3, In.lat[n - 1] / 1e3);
+  }
+  fprintf(report, "bucket_us\tcount\n");
+  size_t i = 0;
+  for (long long bound = 1; i < n; bound *= 2) {
+    size_t count = 0;
+    while (i < n && In.lat[i] / 1000 < bound) {
+      count++;
+      i++;
+    }
+    if (count) fprintf(report, "<%lld\t%zu\n", bound, count);
+  }
+  if (report != stdout) fclose(report);
+
+  editorBufferQuit();
+  close(In.outfd);
+  return 0;
+}
+
 /*** init ***/
 
 void initEditor() {
@@ -1152,6 +6099,7 @@ void initEditor() {
   E.rx = 0;             // Rendered cursor column
   E.rowoff = 0;         // Row offset for scrolling
   E.coloff = 0;         // Column offset for scrolling
+  E.subrow = 0;         // Visual line of the top row while wrapping
 
   // Initialize row and file-related variables
   E.numrows = 0;        // Number of rows in the editor
@@ -1163,29 +6111,86 @@ void initEditor() {
   E.statusmsg[0] = '\0';   // Status message text
   E.statusmsg_time = 0;    // Time when the status message was set
   E.syntax = NULL;         // Syntax highlighting rules
-
-  // Get the terminal window size and adjust screen dimensions
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-  E.screenrows -= 2;  // Adjust for status bar and message bar
+  memset(&E.tri, 0, sizeof(E.tri)); // Trigram index is built lazily when idle
+  memset(&E.lines, 0, sizeof(E.lines)); // Line index is built on first use
+  memset(&E.pool, 0, sizeof(E.pool)); // Row buffers come from this pool
+  memset(&E.load, 0, sizeof(E.load)); // Nothing is loading yet
+  memset(&E.raw, 0, sizeof(E.raw)); // Files become rows unless editorLoad finds them unsafe
+  memset(&E.follow, 0, sizeof(E.follow)); // Follow mode is off until asked for
+  E.follow.fd = -1;
+  memset(&E.disk, 0, sizeof(E.disk)); // Recorded when a file is opened
+  E.codec = CODEC_NONE;    // Set when a compressed file is opened
+  E.damaged = 0;           // Set if it turns out corrupt or cut short
+  E.undecoded = CODEC_NONE; // Set if a script opens a file kilo can't decompress
+
+  // Initialize the undo journal
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.limit = KILO_UNDO_CAP; // Maximum bytes of undo history
+
+  // The crash-recovery journal is opened together with a file
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+
+  // Default screen size until the terminal is asked in main()
+  E.screenrows = 24 - 2;
+  E.screencols = 80;
+  E.batch = 0;
+  E.wrap = 0;              // Long rows scroll sideways until ^U
 }
 
+// The benchmark suite (bench.c) includes this file and brings its own main().
+#ifndef KILO_NO_MAIN
 int main(int argc, char *argv[]) {
+  // Scripted and replayed runs never touch the terminal
+  if (argc >= 2 && !strcmp(argv[1], "--batch")) return editorBatch(argc - 2, argv + 2);
+  if (argc >= 2 && !strcmp(argv[1], "--replay")) return editorReplay(argc - 2, argv + 2);
+
+  // --record LOG saves every input byte with a timestamp for --replay
+  if (argc >= 3 && !strcmp(argv[1], "--record")) {
+    In.record = fopen(argv[2], "w");
+    if (!In.record) die("fopen");
+    setvbuf(In.record, NULL, _IOLBF, 0);
+    In.start_ns = editorNowNs();
+    argc -= 2;
+    argv += 2;
+  }
+
   enableRawMode();
   initEditor();
-  // If a filename is provided as a command-line argument, open the file
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+
+  // Get the terminal window size and adjust screen dimensions
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  E.screenrows -= 2;  // Adjust for status bar and message bar
+
+  // --follow FILE keeps appending what is written to the file
+  int follow = argc >= 3 && !strcmp(argv[1], "--follow");
+  if (follow) {
+    argc--;
+    argv++;
+  }
+
+  // Every file named on the command line gets a buffer; the first is shown.
+  for (int i = 1; i < argc; i++) {
+    if (editorBufferOpen(argv[i]) == -1) die("open");
   }
+  editorBufferSwitch(0);
+  if (argc >= 2 && follow) editorFollowStart();
 
-  // Display an initial status message with keyboard shortcuts
-  editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  // Display an initial status message with keyboard shortcuts, unless
+  // opening the files had something to say
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage(
+      "HELP: ^S save | ^Q quit | ^F find | ^R replace | ^G goto | ^Z undo | ^Y redo");
 
   // Main loop for handling user input and updating the display
   while (1) {
     editorRefreshScreen();    // Refresh the screen
+    editorIdle();             // Do background work until a key comes
+    In.busy = 1;
     editorProcessKeypress();  // Process user keypresses
+    In.busy = 0;
   }
 
   return 0;
-}
\ No newline at end of file
+}
+#endif
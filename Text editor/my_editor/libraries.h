@@ -14,19 +14,72 @@
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define KILO_TRI_BITS 16        // log2 of the number of trigram posting buckets
+#define KILO_TRI_BLOCK 8        // Rows covered by one trigram posting entry
+#define KILO_TRI_MIN_ROWS 10000 // Buffers smaller than this are searched linearly
+#define KILO_TRI_STEP_ROWS 4096 // Rows indexed per idle slice
+#define KILO_TRI_MAX_TOUCHED 1024 // Edited rows tracked before the index is cut back
+#define KILO_LINE_SCAN 4096     // Rows past the valid part of the line index added up directly
+
+#define KILO_RX_STEP 256 // Columns between cursor mapping checkpoints of long rows
+#define KILO_WRAP_TABLES 4      // Widths a row keeps wrap layouts for, e.g. one per pane
+#define KILO_SLAB_CHUNK (1 << 20) // Bytes carved into row buffers per slab chunk
+#define KILO_SLAB_MAX 4096      // Largest row block served from slabs (incl. header)
+#define KILO_SPARE_CHUNKS 64    // Released slab chunks kept for reuse by other buffers
+#define KILO_PAGE 4096          // Granularity of the madvise hints on mapped files
+#define KILO_LOAD_THREADS 8     // Most threads used to load a file
+#define KILO_LOAD_MIN_CHUNK (256 * 1024) // Smallest part of a file worth its own loader thread
+#define KILO_LOAD_FIRST (64 * 1024) // Bytes loaded per slice until the first screen is full
+#define KILO_LOAD_SLICE_MS 20   // Time aimed for by each background loading slice
+#define KILO_LOAD_STEP_MAX (64 << 20) // Most bytes loaded by one slice
+#define KILO_DISK_CHECK_MS 1000 // Interval between checks for changes made by other programs
+#define KILO_RELOAD_MAX_D 2048  // Most differing lines diffed exactly when reloading
+#define KILO_SAVE_BUF (64 * 1024) // Bytes buffered between write() calls when saving
+#define KILO_DECODE_BUF (64 * 1024) // Bytes (de)compressed per codec call
+#define KILO_ZSTD_LEVEL 3       // Compression level used when saving .zst files
+#define KILO_JOURNAL_FLUSH_MS 1000 // Interval between journal fsyncs while idle
+#define KILO_JOURNAL_BATCH (1 << 20) // Pending journal bytes forcing an early write
+#define KILO_SNIFF 8000         // Bytes searched for a NUL to tell binary files at open
+#define KILO_HEX_BYTES 16       // Bytes per line of the hex view
+#define KILO_READ_TIMEOUT_MS 100 // Terminal read timeout (VTIME), which also ends escape sequences
+
+#ifndef KILO_UNDO_CAP
+#define KILO_UNDO_CAP (16 << 20) // Bytes of undo history kept (override with -D)
+#endif
+
+#ifndef KILO_HUGE_LINE
+#define KILO_HUGE_LINE (1 << 20) // Longest line opened as a row; longer ones open in the line view (override with -D)
+#endif
+
+#ifndef KILO_MEM_BUDGET
+#define KILO_MEM_BUDGET (256 << 20) // Row memory of all buffers before background ones drop their render caches (override with -D)
+#endif
+
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0])) //filetype Hightlight Database
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#ifdef KILO_GZIP
+#include <zlib.h>
+#endif
+#ifdef KILO_ZSTD
+#include <zstd.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 #endif 